@@ -0,0 +1,344 @@
+// Checks move_collide() against the frozen reference in collide_reference.c
+// and times both. Random bodies on random maps are checked and timed, edge
+// cases on a hand-built map and far off it are checked, and long sweeps are
+// checked and timed. Exits with failure if any position differs.
+// Usage: bench-collide [bodies]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bench/collide_reference.h"
+// move_collide() is static, so it's compiled in here rather than linked
+#include "src/vm.c"
+
+// Not multiples of MAP_CHUNK_SZ, so the edge chunks are partial
+#define BENCH_MAP_WIDTH 150
+#define BENCH_MAP_HEIGHT 100
+#define WALL_COLUMN 1 // sprite in row 0 with flag 0, which everything collides with
+#define MAX_REPORTED 10
+#define TIMED_BODIES 20000 // of each set, at most
+#define TIMING_BLOCK 500
+#define TIMING_PASSES 15
+
+// A body as move_collide() takes it: position, size, velocity
+typedef GvmConstant Body[3];
+
+static uint64_t bench_state = 1;
+static uint8_t (*cells)[4];
+static uint16_t *reference_map;
+// The reference indexes sprites its own way; the map only uses these two
+static const uint8_t reference_sprite_flags[2] = { 0, 1 };
+static uint64_t checked = 0;
+static uint64_t mismatches = 0;
+// Timed positions land here, so the calls can't be optimised away
+static volatile FixedPoint sink;
+
+// Returns: random int in [0, n)
+static int64_t roll(int64_t n)
+{
+	return gvm_rand(&bench_state) % n;
+}
+
+// Returns: random fixed-point pixel coordinate in [lo, hi). Grid lines and
+// whole pixels are weighted in, since that's where the rounding differs.
+static FixedPoint roll_fixed(int64_t lo, int64_t hi)
+{
+	switch (roll(4)) {
+		case 0:
+			return int_to_fixed(SPRITE_SZ * ((lo + roll(hi - lo)) / SPRITE_SZ));
+		case 1:
+			return int_to_fixed(lo + roll(hi - lo));
+		default:
+			return int_to_fixed(lo) + roll(int_to_fixed(hi - lo));
+	}
+}
+
+static void set_wall(int x, int y, bool wall)
+{
+	int i = y * BENCH_MAP_WIDTH + x;
+	cells[i][0] = wall ? WALL_COLUMN : 0;
+	cells[i][1] = 0;
+	cells[i][2] = 0;
+	cells[i][3] = 0;
+	reference_map[i] = wall ? 1 : 0;
+}
+
+// Gives the walls set so far to both the VM and the reference
+static bool commit_map()
+{
+	free_map_chunks();
+	reference_set_map(reference_map, reference_sprite_flags, BENCH_MAP_WIDTH, BENCH_MAP_HEIGHT);
+	return set_introspection_map((const uint8_t (*)[4])cells, BENCH_MAP_WIDTH, BENCH_MAP_HEIGHT);
+}
+
+// Fills the map with walls on roughly density percent of tiles
+static bool load_map(int density)
+{
+	for (int y = 0; y < BENCH_MAP_HEIGHT; ++y) {
+		for (int x = 0; x < BENCH_MAP_WIDTH; ++x) {
+			set_wall(x, y, roll(100) < density);
+		}
+	}
+	return commit_map();
+}
+
+static void make_body(Body body, FixedPoint x, FixedPoint y, FixedPoint w, FixedPoint h, FixedPoint vx, FixedPoint vy)
+{
+	body[0] = val_vec2_make(x, y);
+	body[1] = val_vec2_make(w, h);
+	body[2] = val_vec2_make(vx, vy);
+}
+
+static FixedPoint collide_current(const Body body)
+{
+	return move_collide(body[0], body[1], body[2], 0).as.vec2[0];
+}
+
+static FixedPoint collide_reference(const Body body)
+{
+	int64_t moved[2];
+	reference_move_collide(body[0].as.vec2, body[1].as.vec2, body[2].as.vec2, 1, moved);
+	return moved[0];
+}
+
+// Runs one body through both and reports if they differ
+static void check_body(const Body body)
+{
+	int64_t expected[2];
+	reference_move_collide(body[0].as.vec2, body[1].as.vec2, body[2].as.vec2, 1, expected);
+	GvmConstant moved = move_collide(body[0], body[1], body[2], 0);
+
+	++checked;
+	if (moved.as.vec2[0] != expected[0] || moved.as.vec2[1] != expected[1]) {
+		if (mismatches < MAX_REPORTED) {
+			printf("Mismatch: position (%ld, %ld) size (%ld, %ld) velocity (%ld, %ld): got (%ld, %ld), reference (%ld, %ld)\n",
+				body[0].as.vec2[0], body[0].as.vec2[1], body[1].as.vec2[0], body[1].as.vec2[1],
+				body[2].as.vec2[0], body[2].as.vec2[1], moved.as.vec2[0], moved.as.vec2[1], expected[0], expected[1]);
+		}
+		++mismatches;
+	}
+}
+
+// Returns: time of a call over the first TIMED_BODIES bodies, in ns. Each block
+// of bodies is timed several times and the quickest taken, so that other load
+// on the machine counts for as little as possible.
+static double time_bodies(FixedPoint (*collide)(const Body), const Body *bodies, uint32_t n_bodies)
+{
+	n_bodies = n_bodies < TIMED_BODIES ? n_bodies : TIMED_BODIES;
+	double total = 0;
+	for (uint32_t block = 0; block < n_bodies; block += TIMING_BLOCK) {
+		uint32_t end_body = block + TIMING_BLOCK < n_bodies ? block + TIMING_BLOCK : n_bodies;
+		double best = 0;
+		for (int pass = 0; pass < TIMING_PASSES; ++pass) {
+			struct timespec start, end;
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+			for (uint32_t i = block; i < end_body; ++i) {
+				sink = collide(bodies[i]);
+			}
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+			double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+			best = 0 == pass || seconds < best ? seconds : best;
+		}
+		total += best;
+	}
+	return total * 1e9 / n_bodies;
+}
+
+// Random bodies anywhere on the map and a little way off it, moving up to 3
+// tiles a frame, checked and then timed against the reference. The reference
+// can't start further off the top or left than it does here.
+static bool bench_random(int density, Body *bodies, uint32_t n_bodies)
+{
+	if (!load_map(density)) {
+		return false;
+	}
+	for (uint32_t i = 0; i < n_bodies; ++i) {
+		FixedPoint x = roll_fixed(-20, BENCH_MAP_WIDTH * SPRITE_SZ + 20);
+		FixedPoint y = roll_fixed(-20, BENCH_MAP_HEIGHT * SPRITE_SZ + 20);
+		FixedPoint w = roll_fixed(0, 2 * SPRITE_SZ + 6);
+		FixedPoint h = roll_fixed(0, 2 * SPRITE_SZ + 6);
+		FixedPoint vx = roll_fixed(-3 * SPRITE_SZ, 3 * SPRITE_SZ + 1);
+		FixedPoint vy = roll_fixed(-3 * SPRITE_SZ, 3 * SPRITE_SZ + 1);
+		make_body(bodies[i], x, y, w, h, vx, vy);
+		check_body(bodies[i]);
+	}
+
+	double current = time_bodies(collide_current, (const Body *)bodies, n_bodies);
+	double reference = time_bodies(collide_reference, (const Body *)bodies, n_bodies);
+	printf("Random bodies, %2d%% walls: %6.2fM collisions/s, reference %6.2fM/s\n",
+		density, 1e3 / current, 1e3 / reference);
+	return true;
+}
+
+// Every combination of the offsets from an anchor tile corner, sizes and
+// velocities below: exact grid alignment, zero velocity and single-unit
+// amounts either side of both are among them
+static void check_around(int64_t anchor_x, int64_t anchor_y)
+{
+	static const FixedPoint offsets[] = { -30000000, -24000000, -12500000, -12000000, -6000000, -1, 0, 1, 6000000, 12000000 };
+	static const FixedPoint sizes[] = { 0, 12000000, 18500000 };
+	static const FixedPoint speeds[] = { -25000000, -12000000, -6500000, -1, 0, 1, 6500000, 12000000, 25000000 };
+	const int n_offsets = sizeof(offsets) / sizeof(offsets[0]);
+	const int n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+	const int n_speeds = sizeof(speeds) / sizeof(speeds[0]);
+
+	for (int i = 0; i < n_offsets * n_offsets; ++i) {
+		FixedPoint x = int_to_fixed(anchor_x * SPRITE_SZ) + offsets[i % n_offsets];
+		FixedPoint y = int_to_fixed(anchor_y * SPRITE_SZ) + offsets[i / n_offsets];
+		// Further off the map than the reference can start
+		if (x < int_to_fixed(-20) || y < int_to_fixed(-20)) {
+			continue;
+		}
+		for (int j = 0; j < n_sizes * n_sizes; ++j) {
+			for (int k = 0; k < n_speeds * n_speeds; ++k) {
+				Body body;
+				make_body(body, x, y, sizes[j % n_sizes], sizes[j / n_sizes], speeds[k % n_speeds], speeds[k / n_speeds]);
+				check_body(body);
+			}
+		}
+	}
+}
+
+// A block of walls, to slide along and round the outside corners of; an L of
+// walls, to slide into the inside corner of; and a one-tile gap between two
+// walls. Bodies start around the corners of each, and of the map.
+static bool check_edge_cases()
+{
+	for (int y = 0; y < BENCH_MAP_HEIGHT; ++y) {
+		for (int x = 0; x < BENCH_MAP_WIDTH; ++x) {
+			bool block = 10 <= x && x < 13 && 10 <= y && y < 13;
+			bool l_shape = (20 <= x && x < 25 && 20 == y) || (20 == x && 20 <= y && y < 25);
+			bool gap = 30 == y && (30 == x || 32 == x);
+			set_wall(x, y, block || l_shape || gap);
+		}
+	}
+	if (!commit_map()) {
+		return false;
+	}
+
+	static const int64_t anchors[][2] = {
+		{ 10, 10 }, { 13, 10 }, { 10, 13 }, { 13, 13 }, { 11, 10 }, { 10, 11 }, // block
+		{ 21, 21 }, { 25, 21 }, { 21, 25 }, // L, inside corner and ends
+		{ 31, 30 }, { 31, 31 }, // gap
+		{ 0, 0 }, { BENCH_MAP_WIDTH, 0 }, { 0, BENCH_MAP_HEIGHT }, { BENCH_MAP_WIDTH, BENCH_MAP_HEIGHT }, // map
+	};
+	uint64_t was_checked = checked;
+	for (int i = 0; i < sizeof(anchors) / sizeof(anchors[0]); ++i) {
+		check_around(anchors[i][0], anchors[i][1]);
+	}
+	printf("Edge cases: %lu bodies\n", checked - was_checked);
+	return true;
+}
+
+// Bodies whose leading edge starts on a grid line far off the top or left of
+// an empty map, moving onto it. The reference never finishes moving these, so
+// each is compared with the reference moving it from the same place on the
+// map instead: off the map is empty too, so the move is just shifted.
+static bool check_far_negative()
+{
+	if (!load_map(0)) {
+		return false;
+	}
+
+	static const int64_t lines[] = { -24, -36, -48, -120, -600 };
+	static const FixedPoint sizes[] = { 0, 12000000, 18500000 };
+	static const FixedPoint speeds[] = { 1, 6500000, 12000000, 25000000 };
+	const int n_lines = sizeof(lines) / sizeof(lines[0]);
+	const int n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+	const int n_speeds = sizeof(speeds) / sizeof(speeds[0]);
+	const FixedPoint shift = int_to_fixed(60 * SPRITE_SZ);
+
+	uint64_t was_checked = checked;
+	for (int i = 0; i < n_lines; ++i) {
+		for (int j = 0; j < n_sizes; ++j) {
+			for (int k = 0; k < n_speeds; ++k) {
+				FixedPoint edge = int_to_fixed(lines[i]);
+				FixedPoint w = sizes[j];
+				FixedPoint v = speeds[k];
+				Body bodies[3];
+				// Leading edge on the line along x, along y, and both
+				make_body(bodies[0], edge - w, int_to_fixed(SPRITE_SZ), w, w, v, 0);
+				make_body(bodies[1], int_to_fixed(SPRITE_SZ), edge - w, w, w, 0, v);
+				make_body(bodies[2], edge - w, edge - w, w, w, v, v);
+				for (int b = 0; b < 3; ++b) {
+					int64_t shifted[2] = { bodies[b][0].as.vec2[0] + shift, bodies[b][0].as.vec2[1] + shift };
+					int64_t expected[2];
+					reference_move_collide(shifted, bodies[b][1].as.vec2, bodies[b][2].as.vec2, 1, expected);
+					GvmConstant moved = move_collide(bodies[b][0], bodies[b][1], bodies[b][2], 0);
+
+					++checked;
+					if (moved.as.vec2[0] != expected[0] - shift || moved.as.vec2[1] != expected[1] - shift) {
+						if (mismatches < MAX_REPORTED) {
+							printf("Mismatch: position (%ld, %ld) size (%ld, %ld) velocity (%ld, %ld): got (%ld, %ld), reference (%ld, %ld)\n",
+								bodies[b][0].as.vec2[0], bodies[b][0].as.vec2[1], w, w, bodies[b][2].as.vec2[0], bodies[b][2].as.vec2[1],
+								moved.as.vec2[0], moved.as.vec2[1], expected[0] - shift, expected[1] - shift);
+						}
+						++mismatches;
+					}
+				}
+			}
+		}
+	}
+	printf("Far off the map: %lu bodies\n", checked - was_checked);
+	return true;
+}
+
+// Bodies moving 2 to 20 tiles a frame along at least one axis, like
+// projectiles, checked and then timed against the reference
+static bool bench_long_sweeps(int density, Body *bodies, uint32_t n_bodies)
+{
+	if (!load_map(density)) {
+		return false;
+	}
+	for (uint32_t i = 0; i < n_bodies; ++i) {
+		FixedPoint x = roll_fixed(0, BENCH_MAP_WIDTH * SPRITE_SZ);
+		FixedPoint y = roll_fixed(0, BENCH_MAP_HEIGHT * SPRITE_SZ);
+		FixedPoint w = roll_fixed(0, 2 * SPRITE_SZ);
+		FixedPoint h = roll_fixed(0, 2 * SPRITE_SZ);
+		FixedPoint vx, vy;
+		do {
+			vx = roll_fixed(-20 * SPRITE_SZ, 20 * SPRITE_SZ + 1);
+			vy = roll_fixed(-20 * SPRITE_SZ, 20 * SPRITE_SZ + 1);
+		} while (llabs(vx) <= 2 * GRID && llabs(vy) <= 2 * GRID);
+		make_body(bodies[i], x, y, w, h, vx, vy);
+		check_body(bodies[i]);
+	}
+
+	double current = time_bodies(collide_current, (const Body *)bodies, n_bodies);
+	double reference = time_bodies(collide_reference, (const Body *)bodies, n_bodies);
+	printf("Long sweeps, %2d%% walls: %6.1f ns/call, reference %6.1f\n", density, current, reference);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t n_bodies = argc > 1 ? atol(argv[1]) : 200000;
+	n_bodies = n_bodies > 0 ? n_bodies : 1;
+	cells = malloc(sizeof(*cells) * BENCH_MAP_WIDTH * BENCH_MAP_HEIGHT);
+	reference_map = malloc(sizeof(*reference_map) * BENCH_MAP_WIDTH * BENCH_MAP_HEIGHT);
+	Body *bodies = malloc(sizeof(*bodies) * n_bodies);
+	if (NULL == cells || NULL == reference_map || NULL == bodies || !init_vm()) {
+		return EXIT_FAILURE;
+	}
+	set_sprite_flags(1, WALL_COLUMN);
+
+	bool success = true;
+	int densities[] = { 0, 5, 20, 50 };
+	for (int i = 0; i < sizeof(densities) / sizeof(densities[0]); ++i) {
+		success = success && bench_random(densities[i], bodies, n_bodies);
+	}
+	success = success && check_edge_cases();
+	success = success && check_far_negative();
+	uint32_t n_long = n_bodies < TIMED_BODIES ? n_bodies : TIMED_BODIES;
+	for (int i = 0; i < sizeof(densities) / sizeof(densities[0]); ++i) {
+		success = success && bench_long_sweeps(densities[i], bodies, n_long);
+	}
+
+	printf("%lu bodies checked, %lu mismatches\n", checked, mismatches);
+	close_vm();
+	free(cells);
+	free(reference_map);
+	free(bodies);
+	return success && 0 == mismatches ? EXIT_SUCCESS : EXIT_FAILURE;
+}
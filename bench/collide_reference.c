@@ -0,0 +1,524 @@
+// A frozen copy of move_collide() as it was before the FixedPoint rewrite,
+// with the value ops it used, to check later versions against. Function
+// bodies are verbatim; everything is made static so it can't clash with the
+// live code, and struct VM keeps only what collision reads.
+//
+// It hangs when a body moving up or right has its leading edge on a grid line
+// at -2 * SPRITE_SZ or below, so callers must keep clear of that.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "collide_reference.h"
+
+#define SPRITE_SZ 12
+
+typedef int64_t FixedPoint;
+
+typedef enum {
+	VAL_SCALAR,
+	VAL_VEC2,
+} ValueType;
+
+typedef struct {
+	union {
+		FixedPoint scalar;
+		FixedPoint vec2[2];
+	} as;
+	ValueType type;
+} GvmConstant;
+
+static struct {
+	const uint8_t *sprite_flags;
+	const uint16_t *map;
+	uint32_t map_width;
+	uint32_t map_height;
+} vm;
+
+// Fixed-point in range [-10e8 + 1, 10e8 - 1] with resolution of 10e-6
+// This requires 47 bits (plus the sign bit).
+// Int addition/subtraction will never overflow, as the absolute magnitude can
+// only reach 48 bits before we clamp back down.
+// Double multiplication/division is lossless, as doubles have 52 bits of
+// precision at all magnitudes.
+#define FP_DEN 1000000l               // denominator of epsilon
+#define FP_EPS (1.0 / (double)FP_DEN) // resolution and epsilon
+#define FP_MAX (99999999l * FP_DEN)   // greatest magnitude
+#define FX2FL(fx) ((fx) * FP_EPS)     // fixed-point to double
+
+#define SCX(constant) ((constant).as.scalar)
+#define V2X(constant) ((constant).as.vec2[0])
+#define V2Y(constant) ((constant).as.vec2[1])
+
+static GvmConstant scalar(FixedPoint x)
+{
+	GvmConstant c;
+	c.type = VAL_SCALAR;
+	c.as.scalar = x;
+	return c;
+}
+
+static GvmConstant vec2(FixedPoint x, FixedPoint y)
+{
+	GvmConstant c;
+	c.type = VAL_VEC2;
+	c.as.vec2[0] = x;
+	c.as.vec2[1] = y;
+	return c;
+}
+
+static FixedPoint double_to_fixed(double d)
+{
+	// TODO: Round, don't floor
+	return d * FP_DEN;
+}
+
+static FixedPoint int_to_fixed(int x)
+{
+	return x * FP_DEN;
+}
+
+static FixedPoint fixed_add(FixedPoint a, FixedPoint b)
+{
+	FixedPoint res = a + b;
+	if (res > FP_MAX) {
+		return FP_MAX;
+	} else if (res < -FP_MAX) {
+		return -FP_MAX;
+	} else {
+		return res;
+	}
+}
+
+static FixedPoint fixed_subtract(FixedPoint a, FixedPoint b)
+{
+	return fixed_add(a, -b);
+}
+
+// TODO: Avoid visiting float land
+static FixedPoint fixed_multiply(FixedPoint a, FixedPoint b)
+{
+	double a_d = FX2FL(a);
+	double b_d = FX2FL(b);
+	double res = a_d * b_d;
+	return double_to_fixed(res);
+}
+
+// Behaviour undefined when b == 0 - try to catch that case before calling this
+static FixedPoint fixed_divide(FixedPoint a, FixedPoint b)
+{
+	if (b == 0) {
+		if (a > 0) {
+			return FP_MAX;
+		} else if (a < 0) {
+			return -FP_MAX;
+		} else {
+			return 0;
+		}
+	}
+
+	double a_d = FX2FL(a);
+	double b_d = FX2FL(b);
+	double res = a_d / b_d;
+	return double_to_fixed(res);
+}
+
+// Adds two values, respecting the type of the first operand
+// It is up to the caller to ensure matching operands (or not to care)
+static GvmConstant add_vals(GvmConstant a, GvmConstant b)
+{
+	switch (a.type) {
+		case VAL_SCALAR:
+			return scalar(fixed_add(SCX(a), SCX(b)));
+		case VAL_VEC2:
+			return vec2(fixed_add(V2X(a), V2X(b)), fixed_add(V2Y(a), V2Y(b)));
+	}
+
+	return scalar(0); // Unreachable
+}
+
+// Subtracts two values, respecting the type of the first operand
+static GvmConstant subtract_vals(GvmConstant a, GvmConstant b)
+{
+	switch (a.type) {
+		case VAL_SCALAR:
+			return scalar(fixed_subtract(SCX(a), SCX(b)));
+		case VAL_VEC2:
+			return vec2(fixed_subtract(V2X(a), V2X(b)), fixed_subtract(V2Y(a), V2Y(b)));
+	}
+
+	return scalar(0); // Unreachable
+}
+
+// Multiplies two values - for vec2, element-wise multiplication
+static GvmConstant multiply_vals(GvmConstant a, GvmConstant b)
+{
+	switch (a.type) {
+		case VAL_SCALAR:
+			return scalar(fixed_multiply(SCX(a), SCX(b)));
+		case VAL_VEC2:
+			return vec2(fixed_multiply(V2X(a), V2X(b)), fixed_multiply(V2Y(a), V2Y(b)));
+	}
+
+	return scalar(0); // Unreachable
+}
+
+// Divides two values - for vec2, element-wise
+static GvmConstant divide_vals(GvmConstant a, GvmConstant b)
+{
+	switch (a.type) {
+		case VAL_SCALAR:
+			return scalar(fixed_divide(SCX(a), SCX(b)));
+		case VAL_VEC2:
+			return vec2(fixed_divide(V2X(a), V2X(b)), fixed_divide(V2Y(a), V2Y(b)));
+	}
+
+	return scalar(0); // Unreachable
+}
+
+static FixedPoint floor_raw(FixedPoint from, FixedPoint snap)
+{
+	// TODO: Careful, we're cheating here by treating FixedPoints directly
+	FixedPoint ret = snap * (from / snap);
+	if (from < 0) {
+		ret -= snap;
+	}
+	return ret;
+}
+
+// Arguments: scalar 'from', scalar integer 'snap'
+// Returns: nearest exact multiple of snap below from, inclusive
+static GvmConstant floor_val(GvmConstant from, GvmConstant snap)
+{
+	return scalar(floor_raw(SCX(from), SCX(snap)));
+}
+
+static GvmConstant ceil_val(GvmConstant from, GvmConstant snap)
+{
+	return scalar(floor_raw(SCX(from) + SCX(snap) - 1, SCX(snap)));
+}
+
+// Exclusive-range versions of floor and ceil
+// e.g. ceil_val(47, 12) == 48, ceil_val_ex(47, 12) == 48,
+//      ceil_val(48, 12) == 48, ceil_val_ex(48, 12) == 60
+static GvmConstant floor_val_ex(GvmConstant from, GvmConstant snap)
+{
+	return scalar(floor_raw(SCX(from) - 1, SCX(snap)));
+}
+
+static GvmConstant ceil_val_ex(GvmConstant from, GvmConstant snap)
+{
+	return scalar(floor_raw(SCX(from) + SCX(snap), SCX(snap)));
+}
+
+// Compares two values, treating them as scalars
+// To use as GvmConstant, call int_to_scalar()
+static bool val_less_than(GvmConstant a, GvmConstant b)
+{
+	return SCX(a) < SCX(b);
+}
+
+static bool val_greater_than(GvmConstant a, GvmConstant b)
+{
+	return SCX(a) > SCX(b);
+}
+
+static bool val_equal(GvmConstant a, GvmConstant b)
+{
+	return SCX(a) == SCX(b);
+}
+
+static GvmConstant val_vec2_get_x(GvmConstant v)
+{
+	return scalar(V2X(v));
+}
+
+static GvmConstant val_vec2_get_y(GvmConstant v)
+{
+	return scalar(V2Y(v));
+}
+
+static GvmConstant val_vec2_make(GvmConstant x, GvmConstant y)
+{
+	return vec2(SCX(x), SCX(y));
+}
+
+static int fixed_to_int(FixedPoint fx)
+{
+	return floor_raw(fx, FP_DEN) / FP_DEN;
+}
+
+// Returns the integer part of v.x, rounding towards minus infinity
+static int vec2_get_x(GvmConstant v)
+{
+	return fixed_to_int(V2X(v));
+}
+
+static int vec2_get_y(GvmConstant v)
+{
+	return fixed_to_int(V2Y(v));
+}
+
+static GvmConstant int_to_scalar(int x)
+{
+	return scalar(int_to_fixed(x));
+}
+
+// Returns: bitfield of the map at given position (as pixel coordinates)
+static bool get_map_flags(GvmConstant position)
+{
+	int x = vec2_get_x(position);
+	int y = vec2_get_y(position);
+	if (x < 0 || vm.map_width * SPRITE_SZ <= x || y < 0 || vm.map_height * SPRITE_SZ <= y) {
+		return 0;
+	} else {
+		int map_x = x / SPRITE_SZ;
+		int map_y = y / SPRITE_SZ;
+		uint16_t sprite = vm.map[map_x + vm.map_width * map_y];
+		return vm.sprite_flags[sprite];
+	}
+}
+
+// Helper: checks if the given quad is sliding against a map tile with flags
+// matching the given bit. Checks for x-sliding if !transpose, else y-sliding.
+static bool is_sliding_1d(GvmConstant position, GvmConstant size, GvmConstant velocity, uint8_t bit, bool transpose)
+{
+	GvmConstant (*get_x)(GvmConstant) = transpose ? val_vec2_get_y : val_vec2_get_x;
+	GvmConstant (*get_y)(GvmConstant) = transpose ? val_vec2_get_x : val_vec2_get_y;
+
+	// Horizontal sliding is determined by vertical movement and vice-versa
+	GvmConstant v = get_y(velocity);
+	GvmConstant x0 = get_x(position);
+	GvmConstant y0 = get_y(position);
+	GvmConstant x1 = add_vals(x0, get_x(size));
+	GvmConstant y1 = add_vals(y0, get_y(size));
+
+	GvmConstant zero = int_to_scalar(0);
+	GvmConstant grid = int_to_scalar(SPRITE_SZ);
+
+	if (val_less_than(v, zero)) {
+		GvmConstant boundary = floor_val(y0, grid);
+		if (val_equal(y0, boundary)) {
+			GvmConstant map_y = subtract_vals(y0, grid);
+			for (GvmConstant map_x = floor_val(x0, grid); val_less_than(map_x, x1); map_x = add_vals(map_x, grid)) {
+				GvmConstant map_position = val_vec2_make(transpose ? map_y : map_x, transpose ? map_x : map_y);
+				uint8_t flags = get_map_flags(map_position);
+				if ((bit & flags) != 0) {
+					return true;
+				}
+			}
+			return false;
+		} else {
+			return false;
+		}
+	} else if (val_greater_than(v, zero)) {
+		GvmConstant boundary = ceil_val(y1, grid);
+		if (val_equal(y1, boundary)) {
+			GvmConstant map_y = y1;
+			for (GvmConstant map_x = floor_val(x0, grid); val_less_than(map_x, x1); map_x = add_vals(map_x, grid)) {
+				GvmConstant map_position = val_vec2_make(transpose ? map_y : map_x, transpose ? map_x : map_y);
+				uint8_t flags = get_map_flags(map_position);
+				if ((bit & flags) != 0) {
+					return true;
+				}
+			}
+			return false;
+		} else {
+			return false;
+		}
+	} else {
+		// Even if we're on a grid boundary, no vertical movement means no slide
+		return false;
+	}
+}
+
+static bool is_sliding_x(GvmConstant position, GvmConstant size, GvmConstant velocity, uint8_t bit)
+{
+	return is_sliding_1d(position, size, velocity, bit, false);
+}
+
+static bool is_sliding_y(GvmConstant position, GvmConstant size, GvmConstant velocity, uint8_t bit)
+{
+	return is_sliding_1d(position, size, velocity, bit, true);
+}
+
+// Moves position to the next grid boundary
+// Returns: time of impact (or very big value if it never hits one), and places
+// position of impact in out_position
+static GvmConstant move_to_boundary(GvmConstant position, GvmConstant size, GvmConstant velocity, GvmConstant *out_position)
+{
+	GvmConstant zero = int_to_scalar(0);
+	GvmConstant grid = int_to_scalar(SPRITE_SZ);
+
+	GvmConstant x0 = val_vec2_get_x(position);
+	GvmConstant y0 = val_vec2_get_y(position);
+	GvmConstant w = val_vec2_get_x(size);
+	GvmConstant h = val_vec2_get_y(size);
+	GvmConstant x1 = add_vals(x0, w);
+	GvmConstant y1 = add_vals(y0, h);
+	GvmConstant vx = val_vec2_get_x(velocity);
+	GvmConstant vy = val_vec2_get_y(velocity);
+
+	// Time to boundary along x-axis
+	GvmConstant tx = int_to_scalar(INT32_MAX);
+	GvmConstant pos_x = position;
+	if (val_less_than(vx, zero)) {
+		GvmConstant lead_x = floor_val_ex(x0, grid);
+		tx = divide_vals(subtract_vals(lead_x, x0), vx);
+		GvmConstant pos_x_y = add_vals(y0, multiply_vals(vy, tx));
+		pos_x = val_vec2_make(lead_x, pos_x_y);
+	} else if (val_greater_than(vx, zero)) {
+		GvmConstant lead_x = ceil_val_ex(x1, grid);
+		tx = divide_vals(subtract_vals(lead_x, x1), vx);
+		GvmConstant pos_x_y = add_vals(y0, multiply_vals(vy, tx));
+		pos_x = val_vec2_make(subtract_vals(lead_x, w), pos_x_y);
+	}
+
+	// Time to boundary along y-axis
+	GvmConstant ty = int_to_scalar(INT32_MAX);
+	GvmConstant pos_y = position;
+	if (val_less_than(vy, zero)) {
+		GvmConstant lead_y = floor_val_ex(y0, grid);
+		ty = divide_vals(subtract_vals(lead_y, y0), vy);
+		GvmConstant pos_y_x = add_vals(x0, multiply_vals(vx, ty));
+		pos_y = val_vec2_make(pos_y_x, lead_y);
+	} else if (val_greater_than(vy, zero)) {
+		GvmConstant lead_y = ceil_val_ex(y1, grid);
+		ty = divide_vals(subtract_vals(lead_y, y1), vy);
+		GvmConstant pos_y_x = add_vals(x0, multiply_vals(vx, ty));
+		pos_y = val_vec2_make(pos_y_x, subtract_vals(lead_y, h));
+	}
+
+	GvmConstant toi = val_less_than(tx, ty) ? tx : ty;
+	// If we calculated position + toi * velocity, we might not end up exactly
+	// on a grid boundary since division and multiplication are not necessarily
+	// inverse operations. That's why we calculate pos_x and pos_y earlier.
+	*out_position = val_less_than(tx, ty) ? pos_x : pos_y;
+	return toi;
+}
+
+// Helper: moves x0 until x0 or (x0 + w) hits a grid boundary
+// All arguments are scalars
+// Returns: time of impact, and places position of impact in out_position
+static GvmConstant slide_to_boundary_1d(GvmConstant x0, GvmConstant w, GvmConstant v, GvmConstant *out_position)
+{
+	GvmConstant x1 = add_vals(x0, w);
+	GvmConstant zero = int_to_scalar(0);
+	GvmConstant grid = int_to_scalar(SPRITE_SZ);
+
+	if (val_less_than(v, zero)) {
+		GvmConstant t0 = divide_vals(subtract_vals(floor_val_ex(x0, grid), x0), v);
+		GvmConstant t1 = divide_vals(subtract_vals(floor_val_ex(x1, grid), x1), v);
+		if (val_less_than(t0, t1)) {
+			*out_position = floor_val_ex(x0, grid);
+			return t0;
+		} else {
+			*out_position = subtract_vals(floor_val_ex(x1, grid), w);
+			return t1;
+		}
+	} else if (val_greater_than(v, zero)) {
+		GvmConstant t0 = divide_vals(subtract_vals(ceil_val_ex(x0, grid), x0), v);
+		GvmConstant t1 = divide_vals(subtract_vals(ceil_val_ex(x1, grid), x1), v);
+		if (val_less_than(t0, t1)) {
+			*out_position = ceil_val_ex(x0, grid);
+			return t0;
+		} else {
+			*out_position = subtract_vals(ceil_val_ex(x1, grid), w);
+			return t1;
+		}
+	} else {
+		*out_position = x0;
+		return int_to_scalar(INT32_MAX);
+	}
+}
+
+// All arguments are vec2s
+// Returns: time of impact, and places position of impact in out_position
+static GvmConstant slide_to_boundary_x(GvmConstant position, GvmConstant size, GvmConstant velocity, GvmConstant *out_position)
+{
+	GvmConstant out_1d;
+	GvmConstant toi = slide_to_boundary_1d(val_vec2_get_x(position), val_vec2_get_x(size), val_vec2_get_x(velocity), &out_1d);
+	*out_position = val_vec2_make(out_1d, val_vec2_get_y(position));
+	return toi;
+}
+
+static GvmConstant slide_to_boundary_y(GvmConstant position, GvmConstant size, GvmConstant velocity, GvmConstant *out_position)
+{
+	GvmConstant out_1d;
+	GvmConstant toi = slide_to_boundary_1d(val_vec2_get_y(position), val_vec2_get_y(size), val_vec2_get_y(velocity), &out_1d);
+	*out_position = val_vec2_make(val_vec2_get_x(position), out_1d);
+	return toi;
+}
+
+// Returns: position + t * [velocity.x, 0]
+static GvmConstant slide_no_collide_x(GvmConstant position, GvmConstant velocity, GvmConstant t)
+{
+	GvmConstant displacement = multiply_vals(val_vec2_get_x(velocity), t);
+	return val_vec2_make(add_vals(val_vec2_get_x(position), displacement), val_vec2_get_y(position));
+}
+
+static GvmConstant slide_no_collide_y(GvmConstant position, GvmConstant velocity, GvmConstant t)
+{
+	GvmConstant displacement = multiply_vals(val_vec2_get_y(velocity), t);
+	return val_vec2_make(val_vec2_get_x(position), add_vals(val_vec2_get_y(position), displacement));
+}
+
+// Returns: position + t * velocity
+static GvmConstant move_no_collide(GvmConstant position, GvmConstant velocity, GvmConstant t)
+{
+	GvmConstant displacement = multiply_vals(velocity, val_vec2_make(t, t));
+	return add_vals(position, displacement);
+}
+
+static GvmConstant move_collide(GvmConstant position, GvmConstant size, GvmConstant velocity, uint8_t bit)
+{
+	GvmConstant t = int_to_scalar(1);
+	GvmConstant zero = int_to_scalar(0);
+
+	while (val_greater_than(t, zero)) {
+		bool sliding_x = is_sliding_x(position, size, velocity, bit);
+		bool sliding_y = is_sliding_y(position, size, velocity, bit);
+		GvmConstant (*to_boundary)(GvmConstant, GvmConstant, GvmConstant, GvmConstant *) = NULL;
+		GvmConstant (*no_collide)(GvmConstant, GvmConstant, GvmConstant) = NULL;
+
+		if (sliding_x && sliding_y) {
+			break;
+		} else if (sliding_x) {
+			to_boundary = slide_to_boundary_x;
+			no_collide = slide_no_collide_x;
+		} else if (sliding_y) {
+			to_boundary = slide_to_boundary_y;
+			no_collide = slide_no_collide_y;
+		} else {
+			to_boundary = move_to_boundary;
+			no_collide = move_no_collide;
+		}
+
+		GvmConstant next_boundary;
+		GvmConstant toi = to_boundary(position, size, velocity, &next_boundary);
+		if (val_greater_than(toi, t)) {
+			position = no_collide(position, velocity, t);
+		} else {
+			position = next_boundary;
+		}
+		t = subtract_vals(t, toi);
+	}
+
+	return position;
+}
+
+void reference_set_map(const uint16_t *map, const uint8_t *sprite_flags, uint32_t width, uint32_t height)
+{
+	vm.map = map;
+	vm.sprite_flags = sprite_flags;
+	vm.map_width = width;
+	vm.map_height = height;
+}
+
+void reference_move_collide(const int64_t position[2], const int64_t size[2], const int64_t velocity[2], uint8_t bit, int64_t out_position[2])
+{
+	GvmConstant moved = move_collide(vec2(position[0], position[1]), vec2(size[0], size[1]), vec2(velocity[0], velocity[1]), bit);
+	out_position[0] = moved.as.vec2[0];
+	out_position[1] = moved.as.vec2[1];
+}
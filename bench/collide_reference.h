@@ -0,0 +1,12 @@
+#ifndef COLLIDE_REFERENCE_H
+#define COLLIDE_REFERENCE_H
+
+#include <stdint.h>
+
+// The map the reference collides with: sprite indices, [height][width], and
+// the flags of each sprite. Both are borrowed, not copied.
+void reference_set_map(const uint16_t *map, const uint8_t *sprite_flags, uint32_t width, uint32_t height);
+// Positions, sizes and velocities are raw fixed-point (x, y) pairs
+void reference_move_collide(const int64_t position[2], const int64_t size[2], const int64_t velocity[2], uint8_t bit, int64_t out_position[2]);
+
+#endif // COLLIDE_REFERENCE_H
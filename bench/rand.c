@@ -0,0 +1,204 @@
+// Checks the quality of gvm_rand() and the VM's rand ops, then times them
+// against the srand48/lrand48 generator they replaced. Exits with failure if
+// any check is out of bounds.
+// Usage: bench-rand
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "src/common.h"
+#include "src/value.h"
+
+#define BIT_ROLLS (1 << 24)
+#define BIT_MAX_Z 5.0
+#define INT_ROLLS 10000000
+#define INT_BUCKETS 100
+#define PAIR_ROLLS 1000000
+#define MAX_CORRELATION 0.01
+#define TIMED_ROLLS 100000000
+
+static bool passed = true;
+// Timed rolls land here, so the loops can't be optimised away
+static volatile uint64_t sink;
+
+static void check(bool ok, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	printf("%s ", ok ? "ok  " : "FAIL");
+	vprintf(format, args);
+	printf("\n");
+	va_end(args);
+	passed = passed && ok;
+}
+
+static double seconds_since(struct timespec start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+// Returns: roll scaled to [0, 1)
+static double unit(uint64_t roll)
+{
+	return (roll >> 11) * (1.0 / (UINT64_C(1) << 53));
+}
+
+// Returns: Pearson correlation of n pairs, given their sums
+static double correlation(double n, double sx, double sy, double sxx, double syy, double sxy)
+{
+	return (n * sxy - sx * sy) / sqrt((n * sxx - sx * sx) * (n * syy - sy * sy));
+}
+
+// The same seed must always give the same sequence, whatever it started as
+static void check_reproducible()
+{
+	FixedPoint seeds[] = { 0, 1, -1, 123456789, -FP_MAX, FP_MAX };
+	bool same = true;
+	for (int i = 0; i < sizeof(seeds) / sizeof(seeds[0]); ++i) {
+		FixedPoint a = seeds[i];
+		FixedPoint b = seeds[i];
+		for (int j = 0; j < 1000; ++j) {
+			same = same && rand_val(&a) == rand_val(&b) && a == b;
+		}
+	}
+	check(same, "same seed gives the same sequence");
+}
+
+// Every bit of a roll should be set half the time
+static void check_bit_bias()
+{
+	static uint32_t counts[64];
+	uint64_t state = 42;
+	for (int i = 0; i < BIT_ROLLS; ++i) {
+		uint64_t roll = gvm_rand(&state);
+		for (int bit = 0; bit < 64; ++bit) {
+			counts[bit] += (roll >> bit) & 1;
+		}
+	}
+
+	double max_z = 0;
+	for (int bit = 0; bit < 64; ++bit) {
+		double z = fabs((counts[bit] - BIT_ROLLS / 2.0) / sqrt(BIT_ROLLS / 4.0));
+		max_z = z > max_z ? z : max_z;
+	}
+	check(max_z < BIT_MAX_Z, "bit bias over %d rolls: max |z| = %.2f", BIT_ROLLS, max_z);
+}
+
+// rand_val() stays in [0, 1), and rand_int_val() hits each int evenly
+static void check_rand_ops()
+{
+	FixedPoint seed = 7;
+	bool in_range = true;
+	for (int i = 0; i < PAIR_ROLLS; ++i) {
+		FixedPoint roll = rand_val(&seed);
+		in_range = in_range && roll >= 0 && roll < int_to_fixed(1);
+	}
+	check(in_range, "rand_val() in [0, 1)");
+
+	static uint32_t buckets[INT_BUCKETS];
+	bool in_bounds = true;
+	for (int i = 0; i < INT_ROLLS; ++i) {
+		FixedPoint roll = rand_int_val(int_to_fixed(INT_BUCKETS), &seed);
+		int bucket = roll / FP_DEN;
+		if (roll % FP_DEN != 0 || bucket < 0 || bucket >= INT_BUCKETS) {
+			in_bounds = false;
+			continue;
+		}
+		++buckets[bucket];
+	}
+	check(in_bounds, "rand_int_val(%d) gives ints in [0, %d)", INT_BUCKETS, INT_BUCKETS);
+
+	double expected = (double)INT_ROLLS / INT_BUCKETS;
+	double chi_square = 0;
+	for (int i = 0; i < INT_BUCKETS; ++i) {
+		chi_square += (buckets[i] - expected) * (buckets[i] - expected) / expected;
+	}
+	// Five standard deviations over the mean of the distribution
+	double dof = INT_BUCKETS - 1;
+	check(chi_square < dof + 5 * sqrt(2 * dof), "rand_int_val(%d) chi-square %.1f with %.0f dof", INT_BUCKETS, chi_square, dof);
+}
+
+// Successive rolls, and first rolls from adjacent seeds, shouldn't correlate
+static void check_correlation()
+{
+	uint64_t state = 99;
+	double prev = unit(gvm_rand(&state));
+	double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+	for (int i = 0; i < PAIR_ROLLS; ++i) {
+		double next = unit(gvm_rand(&state));
+		sx += prev;
+		sy += next;
+		sxx += prev * prev;
+		syy += next * next;
+		sxy += prev * next;
+		prev = next;
+	}
+	double serial = correlation(PAIR_ROLLS, sx, sy, sxx, syy, sxy);
+	check(fabs(serial) < MAX_CORRELATION, "serial correlation %.4f", serial);
+
+	sx = sy = sxx = syy = sxy = 0;
+	for (int i = 0; i < PAIR_ROLLS; ++i) {
+		uint64_t a = i;
+		uint64_t b = i + 1;
+		double x = unit(gvm_rand(&a));
+		double y = unit(gvm_rand(&b));
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		syy += y * y;
+		sxy += x * y;
+	}
+	double adjacent = correlation(PAIR_ROLLS, sx, sy, sxx, syy, sxy);
+	check(fabs(adjacent) < MAX_CORRELATION, "adjacent seed correlation %.4f", adjacent);
+}
+
+// What OP_RAND used to do: reseed libc's generator from the seed slot
+static uint64_t old_rand(uint64_t *state)
+{
+	srand48(*state);
+	*state = lrand48();
+	return *state;
+}
+
+static void time_rng(const char *name, uint64_t (*rng)(uint64_t *))
+{
+	uint64_t state = 1;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < TIMED_ROLLS; ++i) {
+		sink = rng(&state);
+	}
+	double seconds = seconds_since(start);
+	printf("%-16s %.2f ns/roll\n", name, seconds * 1e9 / TIMED_ROLLS);
+}
+
+static void time_rand_val()
+{
+	FixedPoint seed = 1;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < TIMED_ROLLS; ++i) {
+		sink = rand_val(&seed);
+	}
+	double seconds = seconds_since(start);
+	printf("%-16s %.2f ns/roll\n", "rand_val", seconds * 1e9 / TIMED_ROLLS);
+}
+
+int main()
+{
+	check_reproducible();
+	check_bit_bias();
+	check_rand_ops();
+	check_correlation();
+
+	time_rng("gvm_rand", gvm_rand);
+	time_rand_val();
+	time_rng("srand48+lrand48", old_rand);
+
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,72 @@
+// Headless stand-ins for the subsystems, so benchmarks can run the VM without
+// a window. Frames are counted in draw(), and the buttons are a fixed
+// pseudo-random pattern of it so runs are repeatable.
+
+#include "src/subsystems/subsystems.h"
+
+long stub_frame_limit = 100000;
+static long stub_frames = 0;
+static uint32_t stub_buttons = 0;
+
+bool init_subsystems(int window_width, int window_height, int pixel_scale, const char *title, FileCb file_cb, void (*save_cb)(void), void (*reload_cb)(void))
+{
+	return true;
+}
+
+void input()
+{
+}
+
+bool button_pressed(int button)
+{
+	return (stub_buttons >> button) & 1;
+}
+
+bool bind_palette(uint8_t bind_point, uint8_t target)
+{
+	return true;
+}
+
+void set_camera(int x, int y)
+{
+}
+
+bool set_palette_colour(uint8_t palette, uint8_t colour, float r, float g, float b)
+{
+	return true;
+}
+
+bool define_sprite_rows(const uint8_t *data, int n_rows, int sheet_cols, int sheet_rows)
+{
+	return true;
+}
+
+bool register_map(const uint8_t (*map)[4], int width, int height)
+{
+	return true;
+}
+
+bool fill_rect(int x, int y, int w, int h, uint8_t palette, uint8_t colour)
+{
+	return true;
+}
+
+bool sprite(int x, int y, uint8_t sheet_x, uint8_t sheet_y, uint8_t palette, uint8_t h_flip, uint8_t v_flip)
+{
+	return true;
+}
+
+void draw()
+{
+	++stub_frames;
+	stub_buttons = (uint32_t)(stub_frames / 37) * 2654435761u >> 3;
+}
+
+bool window_should_close()
+{
+	return stub_frames >= stub_frame_limit;
+}
+
+void close_subsystems()
+{
+}
@@ -0,0 +1,41 @@
+// Times update() by running a ROM headless for a fixed number of frames.
+// Usage: bench-update <rom> [frames]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "src/parser.h"
+#include "src/vm.h"
+
+extern long stub_frame_limit;
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <rom> [frames]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	stub_frame_limit = argc > 2 ? atol(argv[2]) : 2000000;
+
+	if (!init_vm()) {
+		return EXIT_FAILURE;
+	}
+	if (!load_rom(argv[1])) {
+		close_parser();
+		close_vm();
+		return EXIT_FAILURE;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bool success = run_vm(argv[1]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+	printf("%ld frames: %.3f s, %.1f ns/frame\n", stub_frame_limit, seconds, seconds * 1e9 / stub_frame_limit);
+
+	close_parser();
+	close_vm();
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
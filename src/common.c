@@ -1,6 +1,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "common.h"
 
@@ -38,9 +39,32 @@ void gvm_assert(bool assertion, const char *format, ...)
 	}
 }
 
-// TODO: Better RNG
-long gvm_rand(long seed)
+// Returns: number of CPUs online, at least 1
+int gvm_cpu_count()
 {
-	srand48(seed);
-	return lrand48();
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 1 ? count : 1;
+}
+
+// The RNG is counter-based: the state is a Weyl sequence and each roll is a
+// hash of it, so there's no hidden global state and VMs on different threads
+// can't interfere. The state is kept to 46 bits, which fits in a FixedPoint
+// (and so survives a trip through a state slot or a save file).
+#define RNG_STATE_MASK ((UINT64_C(1) << 46) - 1)
+#define RNG_INCREMENT (UINT64_C(0x9E3779B97F4A7C15) & RNG_STATE_MASK)
+
+// splitmix64's finaliser
+static uint64_t rng_mix(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+	x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+	return x ^ (x >> 31);
+}
+
+// Returns: 64 random bits
+// Advances state, which may start out as any value
+uint64_t gvm_rand(uint64_t *state)
+{
+	*state = (*state + RNG_INCREMENT) & RNG_STATE_MASK;
+	return rng_mix(*state);
 }
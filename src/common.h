@@ -15,14 +15,20 @@
 #define COLOR_RESET "\x1B[0m"
 
 #define SPRITE_SZ 12
-#define SPRITE_COLS 7
-#define SPRITE_ROWS 100
+// A ROM can declare how many columns and rows of sprites its sheet has, up to
+// these: map cells name a column by letter, and a row fits a byte
+#define SPRITE_MAX_COLS 26
+#define SPRITE_MAX_ROWS 256
+#define SPRITE_DEFAULT_COLS 7
+#define SPRITE_DEFAULT_ROWS 100
 #define N_SPRITE_FLAGS 8
+#define N_ENTITY_LAYERS 256
 
 void gvm_log(const char *format, ...);
 void gvm_error(const char *format, ...);
 void gvm_assert(bool assertion, const char *format, ...);
 
-long gvm_rand(long seed);
+int gvm_cpu_count();
+uint64_t gvm_rand(uint64_t *state);
 
 #endif // COMMON_H
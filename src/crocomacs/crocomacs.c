@@ -72,7 +72,7 @@ void ccm_runtime_error(const char *message)
 }
 
 // Shallow-define macros but do not run.
-// 'length' must exclude the null terminator.
+// 'source' needn't be null-terminated; 'length' must exclude any terminator.
 // Failure modes:
 // - Parse error
 bool ccm_compile(const char *source, int length, int initial_line)
@@ -100,7 +100,23 @@ bool ccm_execute(const char *source, int length, int initial_line)
 	return eval_macro(CURRENT_PROGRAM, 0);
 }
 
-// Frees all memory taken by Crocomacs, forgetting macros and primitives.
+// Keeps all macros defined so far through ccm_forget_macros(). Macros defined
+// after this with the same name shadow them until they're forgotten.
+// Failure modes:
+// - Allocation failure (some macros may already be kept)
+bool ccm_keep_macros()
+{
+	return keep_macros();
+}
+
+// Forgets macros not kept by ccm_keep_macros(), but not primitives or hooks.
+void ccm_forget_macros()
+{
+	forget_macros();
+}
+
+// Frees all memory taken by Crocomacs, forgetting macros (kept or not) and
+// primitives.
 void ccm_cleanup()
 {
 	ccm_set_number_hook(NULL);
@@ -108,4 +124,5 @@ void ccm_cleanup()
 	ccm_set_symbol_hook(NULL);
 	forget_primitives();
 	forget_macros();
+	forget_kept_macros();
 }
@@ -16,6 +16,8 @@ void ccm_set_symbol_hook(CcmSymbolHook);
 void ccm_runtime_error(const char *message); // TODO: accept '...'
 bool ccm_compile(const char *source, int length, int initial_line);
 bool ccm_execute(const char *source, int length, int initial_line);
+bool ccm_keep_macros();
+void ccm_forget_macros();
 void ccm_cleanup();
 
 #endif // CROCOMACS_H
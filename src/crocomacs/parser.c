@@ -221,9 +221,19 @@ static bool string(Token t, Sentence *current)
 // TODO: See scanner::number()
 static bool number(Token t, Sentence *current)
 {
+	// Sources needn't be null-terminated (they may be mapped files), so strtod()
+	// gets a terminated copy rather than running off the end
+	char chars[64];
+	if (t.length >= sizeof(chars)) {
+		error_at(t, "Number too long");
+		return false;
+	}
+	memcpy(chars, t.chars, t.length);
+	chars[t.length] = '\0';
+
 	char *endptr;
-	double d = strtod(t.chars, &endptr);
-	if (endptr != t.chars + t.length) {
+	double d = strtod(chars, &endptr);
+	if (endptr != chars + t.length) {
 		// Scanner passed us a bad double
 		error_at(t, "Failed to parse number");
 		return false;
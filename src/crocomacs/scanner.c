@@ -45,9 +45,10 @@ static bool is_at_end()
 	return tapehead == end;
 }
 
+// Sources needn't be null-terminated, so nothing is read at the end
 static char peek()
 {
-	return *tapehead;
+	return is_at_end() ? '\0' : *tapehead;
 }
 
 static char advance()
@@ -63,7 +64,8 @@ static char advance()
 			++character;
 			break;
 	}
-	return *(++tapehead);
+	++tapehead;
+	return peek();
 }
 
 static void start_token()
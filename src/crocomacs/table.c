@@ -41,6 +41,14 @@ static struct table macros_table = {
 	.entries = NULL,
 };
 
+// Macros moved here by keep_macros() survive forget_macros(), but are
+// shadowed by macros_table
+static struct table kept_macros_table = {
+	.count = 0,
+	.capacity = 0,
+	.entries = NULL,
+};
+
 void print_word(Word *w)
 {
 	switch (w->type) {
@@ -311,10 +319,46 @@ void forget_macros()
 	free_table(&macros_table);
 }
 
+// Moves all macros to the kept table, replacing kept macros of the same name
+// Returns: success. On failure, macros not yet moved stay where they were.
+bool keep_macros()
+{
+	if (kept_macros_table.count == 0) {
+		free_table(&kept_macros_table);
+		kept_macros_table = macros_table;
+		macros_table = (struct table){ .count = 0, .capacity = 0, .entries = NULL };
+		return true;
+	}
+
+	for (int i = 0; i < macros_table.capacity; ++i) {
+		struct entry *entry = &macros_table.entries[i];
+		if (is_empty(entry)) {
+			continue;
+		}
+		// Takes the expansion, but copies the name
+		if (!table_set(&kept_macros_table, entry->key.as.str.chars, entry->key.as.str.length, &entry->value)) {
+			return false;
+		}
+		free_word(&entry->key);
+		entry->key.as.str.chars = TOMBSTONE;
+		--macros_table.count;
+	}
+	free_table(&macros_table);
+	return true;
+}
+
+void forget_kept_macros()
+{
+	free_table(&kept_macros_table);
+}
+
 // Returns NULL on failure; populates *out_arg_count on success
 Sentence *expand_macro(const char *name, int name_length, int *out_arg_count)
 {
 	struct entry *entry = table_get(&macros_table, name, name_length);
+	if (entry == NULL) {
+		entry = table_get(&kept_macros_table, name, name_length);
+	}
 	if (entry == NULL) {
 		return NULL;
 	} else {
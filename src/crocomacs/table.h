@@ -56,6 +56,8 @@ CcmHook get_primitive(const char *name, int name_length, int *out_arg_count);
 bool define_macro(const char *name, int name_length, int arg_count, Sentence *expansion);
 void forget_macro(const char *name, int name_length);
 void forget_macros();
+bool keep_macros();
+void forget_kept_macros();
 Sentence *expand_macro(const char *name, int name_length, int *out_arg_count);
 
 #endif // CROCOMACS_TABLE_H
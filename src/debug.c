@@ -29,11 +29,18 @@ static int disassemble_instruction(int i)
 	OpCode instruction = vm.instructions[i];
 	switch (instruction) {
 		CASE_BYTE(OP_GET);
+		CASE_BYTE(OP_GET_VEC2);
 		CASE_BYTE(OP_SET);
+		CASE_BYTE(OP_SET_VEC2);
 		CASE_BYTE(OP_LOAD_CONST);
+		CASE_BYTE(OP_LOAD_CONST_VEC2);
+		CASE_BYTE(OP_LOAD_DATA);
 		CASE(OP_ADD);
 		CASE(OP_SUBTRACT);
 		CASE(OP_MULTIPLY);
+		CASE(OP_ADD_VEC2);
+		CASE(OP_SUBTRACT_VEC2);
+		CASE(OP_MULTIPLY_VEC2);
 		CASE(OP_MODULO);
 		CASE_BYTE(OP_RAND);
 		CASE_BYTE(OP_RAND_INT);
@@ -41,6 +48,11 @@ static int disassemble_instruction(int i)
 		CASE(OP_GET_Y);
 		CASE(OP_MAKE_VEC2);
 		CASE(OP_NORMALIZE);
+		CASE(OP_LENGTH);
+		CASE(OP_ATAN2);
+		CASE(OP_ROTATE);
+		CASE(OP_SIN);
+		CASE(OP_COS);
 		CASE_32BIT(OP_JUMP_IF_FALSE);
 		CASE_32BIT(OP_JUMP);
 		CASE(OP_LESS_THAN);
@@ -55,12 +67,20 @@ static int disassemble_instruction(int i)
 		CASE(OP_MAP_HEIGHT);
 		CASE_BYTE(OP_MAP_FLAG);
 		CASE_BYTE(OP_MOVE_COLLIDE);
+		CASE_BYTE(OP_RAYCAST);
+		CASE_BYTE(OP_PATH);
 		CASE_2BYTE(OP_FILL_RECT);
 		CASE_5BYTE(OP_SPRITE);
+		CASE_BYTE(OP_ENTITY);
+		CASE_BYTE(OP_OVERLAPS);
+		CASE(OP_HIT);
 		CASE(OP_SWAP);
+		CASE(OP_SWAP_VEC2);
 		CASE(OP_DUP);
+		CASE(OP_DUP_VEC2);
 		CASE(OP_POP);
-		CASE(OP_PRINT);
+		CASE(OP_POP_VEC2);
+		CASE_BYTE(OP_PRINT);
 		CASE(OP_RETURN);
 		default:
 			gvm_log("UNKNOWN INSTRUCTION 0x%2x\n", instruction);
@@ -79,8 +99,19 @@ void disassemble()
 {
 	gvm_log("🐊 State\n");
 	for (int i = 0; i < vm.state_count; ++i) {
-		gvm_log("%s: ", vm.state[i].name);
-		print_value(vm.state[i].value);
+		gvm_log("%s: ", vm.state_info[i].name);
+		print_value(vm.state[i], vm.state_info[i].type);
+		gvm_log("\n");
+	}
+
+	gvm_log("🐊 Data\n");
+	for (int i = 0; i < vm.data_table_count; ++i) {
+		const GvmDataTable *table = &vm.data_tables[i];
+		gvm_log("%s:", vm.data_names[i]);
+		for (uint32_t j = 0; j < table->length; ++j) {
+			gvm_log(" ");
+			print_value(scalar_to_constant(vm.data[table->start + j]), VAL_SCALAR);
+		}
 		gvm_log("\n");
 	}
 
@@ -1,8 +1,10 @@
 #define _POSIX_C_SOURCE 200112L // fdopen(), localtime_r()
 
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -39,6 +41,40 @@ static bool make_absolute_path(const char *relative, char *out_buf, size_t bufsi
 	return true;
 }
 
+// Maps a regular file read-only. Empty files can't be mapped, and nor can
+// some filesystems' files, so there's always read_file_impl() to fall back on.
+// The view is only good while the file isn't truncated, as reading a page
+// past its new end raises SIGBUS. That's fine for predefs, shaders and saves,
+// which nothing rewrites while they're read, but not for the watched ROM: see
+// read_file_copied().
+// Returns: success
+static bool map_file_impl(const char *absolute, FileView *out_view)
+{
+	int fd = open(absolute, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat out_stat;
+	if (fstat(fd, &out_stat) == -1 || !S_ISREG(out_stat.st_mode)
+		|| out_stat.st_size <= 0 || out_stat.st_size > INT_MAX) {
+		close(fd);
+		return false;
+	}
+
+	// The mapping outlives the descriptor
+	void *view = mmap(NULL, out_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == view) {
+		return false;
+	}
+
+	out_view->chars = view;
+	out_view->length = out_stat.st_size;
+	out_view->mapped = true;
+	return true;
+}
+
 static char *read_file_impl(const char *absolute, int *out_length)
 {
 	// Check that it's an actual file
@@ -95,6 +131,17 @@ time_t last_modified(const char *path)
 	return out_stat.st_mtime;
 }
 
+// As last_modified, for a path relative to running executable
+time_t last_modified_executable(const char *path)
+{
+	char full_path[256] = { 0 };
+	if (!make_absolute_path(path, full_path, sizeof(full_path))) {
+		return MODIFY_ERROR;
+	}
+
+	return last_modified(full_path);
+}
+
 // Returns: writable handle to file with unique name, or NULL on failure
 // On success, ownership is transferred: call fclose(file) when done. path is
 // assumed to be relative to the cwd.
@@ -129,24 +176,63 @@ FILE *open_unique(const char *path, const char *suffix)
 	}
 }
 
-// Opens path relative to cwd and reads to a buffer
-// Returns: the buffer, and transfers ownership (or NULL if anything failed).
-// On success, *out_length (if not NULL) contains the file's size in bytes.
-char *read_file(const char *path, int *out_length)
+static bool copy_file_impl(const char *absolute, FileView *out_view)
+{
+	int length;
+	char *buffer = read_file_impl(absolute, &length);
+	if (NULL == buffer) {
+		return false;
+	}
+
+	out_view->chars = buffer;
+	out_view->length = length;
+	out_view->mapped = false;
+	return true;
+}
+
+static bool view_file_impl(const char *absolute, FileView *out_view)
+{
+	return map_file_impl(absolute, out_view) || copy_file_impl(absolute, out_view);
+}
+
+// Opens path relative to cwd and views its contents, which aren't
+// null-terminated
+// Returns: success. On success, ownership of *out_view is transferred: call
+// close_file_view(out_view) when done.
+bool read_file(const char *path, FileView *out_view)
 {
-	return read_file_impl(path, out_length);
+	return view_file_impl(path, out_view);
 }
 
-// Opens path relative to running executable and reads to a buffer
+// As read_file, but always copies the contents to the heap, for a file that
+// may be rewritten while it's read. A copy that races a truncation comes up
+// short and fails, where a mapping would fault.
+bool read_file_copied(const char *path, FileView *out_view)
+{
+	return copy_file_impl(path, out_view);
+}
+
+// Opens path relative to running executable and views its contents
 // Returns: same as read_file
-char *read_file_executable(const char *path, int *out_length)
+bool read_file_executable(const char *path, FileView *out_view)
 {
 	char full_path[256] = { 0 };
 
 	bool filepath_success = make_absolute_path(path, full_path, sizeof(full_path));
 	if (!filepath_success) {
-		return NULL;
+		return false;
 	}
 
-	return read_file_impl(full_path, out_length);
+	return view_file_impl(full_path, out_view);
+}
+
+void close_file_view(FileView *view)
+{
+	if (view->mapped) {
+		munmap((void *)view->chars, view->length);
+	} else {
+		gvm_free((void *)view->chars);
+	}
+	view->chars = NULL;
+	view->length = 0;
 }
@@ -1,14 +1,25 @@
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <time.h>
 
 #define MODIFY_ERROR -1
 
+// A file's contents, read-only: mapped where possible, else copied to the heap
+typedef struct {
+	const char *chars;
+	int length;
+	bool mapped;
+} FileView;
+
 time_t last_modified(const char *path);
+time_t last_modified_executable(const char *path);
 FILE *open_unique(const char *path, const char *suffix);
-char *read_file(const char *path, int *out_length);
-char *read_file_executable(const char *path, int *out_length);
+bool read_file(const char *path, FileView *out_view);
+bool read_file_copied(const char *path, FileView *out_view);
+bool read_file_executable(const char *path, FileView *out_view);
+void close_file_view(FileView *view);
 
 #endif // FILESYSTEM_H
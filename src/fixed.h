@@ -0,0 +1,89 @@
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <stdint.h>
+
+// The fixed-point primitives behind value.h. They live here as inlines so hot
+// loops elsewhere in the VM can use them directly without changing a bit of
+// their behaviour. Outside of those, go through value.h.
+
+typedef int64_t FixedPoint;
+
+// Fixed-point in range [-10e8 + 1, 10e8 - 1] with resolution of 10e-6
+// This requires 47 bits (plus the sign bit).
+// Int addition/subtraction will never overflow, as the absolute magnitude can
+// only reach 48 bits before we clamp back down.
+// Double multiplication/division is lossless, as doubles have 52 bits of
+// precision at all magnitudes.
+#define FP_DEN 1000000l               // denominator of epsilon
+#define FP_EPS (1.0 / (double)FP_DEN) // resolution and epsilon
+#define FP_MAX (99999999l * FP_DEN)   // greatest magnitude
+#define FX2FL(fx) ((fx) * FP_EPS)     // fixed-point to double
+
+static inline FixedPoint double_to_fixed(double d)
+{
+	// TODO: Round, don't floor
+	return d * FP_DEN;
+}
+
+static inline FixedPoint int_to_fixed(int x)
+{
+	return x * FP_DEN;
+}
+
+static inline FixedPoint fixed_add(FixedPoint a, FixedPoint b)
+{
+	FixedPoint res = a + b;
+	if (res > FP_MAX) {
+		return FP_MAX;
+	} else if (res < -FP_MAX) {
+		return -FP_MAX;
+	} else {
+		return res;
+	}
+}
+
+static inline FixedPoint fixed_subtract(FixedPoint a, FixedPoint b)
+{
+	return fixed_add(a, -b);
+}
+
+// TODO: Avoid visiting float land
+static inline FixedPoint fixed_multiply(FixedPoint a, FixedPoint b)
+{
+	double a_d = FX2FL(a);
+	double b_d = FX2FL(b);
+	double res = a_d * b_d;
+	return double_to_fixed(res);
+}
+
+// Behaviour undefined when b == 0 - try to catch that case before calling this
+static inline FixedPoint fixed_divide(FixedPoint a, FixedPoint b)
+{
+	if (b == 0) {
+		if (a > 0) {
+			return FP_MAX;
+		} else if (a < 0) {
+			return -FP_MAX;
+		} else {
+			return 0;
+		}
+	}
+
+	double a_d = FX2FL(a);
+	double b_d = FX2FL(b);
+	double res = a_d / b_d;
+	return double_to_fixed(res);
+}
+
+static inline FixedPoint floor_raw(FixedPoint from, FixedPoint snap)
+{
+	// TODO: Careful, we're cheating here by treating FixedPoints directly
+	FixedPoint ret = snap * (from / snap);
+	if (from < 0) {
+		ret -= snap;
+	}
+	return ret;
+}
+
+#endif // FIXED_H
@@ -30,6 +30,7 @@ int main(int argc, char *argv[])
 
 	gvm_log("Loading from %s...\n", rom_path);
 	if (!load_rom(rom_path)) {
+		close_parser();
 		close_vm();
 		close_subsystems();
 		return EXIT_FAILURE;
@@ -40,6 +41,7 @@ int main(int argc, char *argv[])
 #endif
 
 	bool success = run_vm(rom_path);
+	close_parser();
 	close_vm();
 	close_subsystems();
 	return success ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -1,3 +1,6 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "common.h"
@@ -13,6 +16,19 @@
 static uint32_t jump_stack[256];
 static int jump_count = 0;
 
+// Hashes of each section as of the last load that succeeded, so a reload can
+// skip what hasn't changed
+static uint64_t section_hashes[N_ROM_SECTIONS];
+static bool have_section_hashes = false;
+
+// Primitives and predef macros stay in Crocomacs between parses of UPDATE, and
+// are rebuilt when predefs.ccm changes. MODIFY_ERROR if they aren't there.
+static time_t predefs_timestamp = MODIFY_ERROR;
+
+// Where renderer calls from a reload off the main thread are held back, or
+// NULL to make them right away
+static RomStaging *current_staging = NULL;
+
 // Static stack analysis
 static ValueType stack[256]; // TODO: array length magical
 static int stack_count = 0;
@@ -90,7 +106,7 @@ static void *gvm_ccm_realloc_wrapper(void *ptr, size_t size)
 
 static void hook_number(double d)
 {
-	if (constant(double_to_scalar(d))) {
+	if (constant(scalar_to_constant(double_to_scalar(d)), VAL_SCALAR)) {
 		push(VAL_SCALAR);
 	} else {
 		ccm_runtime_error("Too many constants");
@@ -104,8 +120,9 @@ static void hook_string(const char *str, int length)
 
 static void hook_symbol(const char *str, int length)
 {
-	if (state_instruction(OP_GET, str, length)) {
-		push(state_type(str, length));
+	ValueType type = state_type(str, length);
+	if (state_instruction(type == VAL_VEC2 ? OP_GET_VEC2 : OP_GET, str, length)) {
+		push(type);
 	} else {
 		ccm_runtime_error("Invalid variable name"); // could also be an allocation failure
 	}
@@ -115,13 +132,13 @@ static void hook_DEFINE_SCALAR(CcmList lists[])
 {
 	const char *name = lists[0].values[0].as.str.chars;
 	int length = lists[0].values[0].as.str.length;
-	GvmConstant value = double_to_scalar(lists[1].values[0].as.number);
+	GvmConstant value = scalar_to_constant(double_to_scalar(lists[1].values[0].as.number));
 	// TODO: Not bothered to error-check this because we should null-terminate
 	// CcmValue strings anyway
 	char *name_copy = gvm_malloc(length + 1);
 	memcpy(name_copy, name, length);
 	name_copy[length] = '\0';
-	define_state(value, name_copy);
+	define_state(value, VAL_SCALAR, name_copy);
 	gvm_free(name_copy);
 }
 
@@ -133,10 +150,26 @@ static void hook_DEFINE_VEC2(CcmList lists[])
 	char *name_copy = gvm_malloc(length + 1);
 	memcpy(name_copy, name, length);
 	name_copy[length] = '\0';
-	define_state(value, name_copy);
+	define_state(value, VAL_VEC2, name_copy);
 	gvm_free(name_copy);
 }
 
+static void stage_palette(StagedPalette call)
+{
+	if (current_staging->n_palettes >= current_staging->palette_capacity) {
+		int capacity = current_staging->palette_capacity > 0 ? current_staging->palette_capacity * 2 : 16;
+		StagedPalette *palettes = gvm_realloc(current_staging->palettes, sizeof(*palettes) * current_staging->palette_capacity, sizeof(*palettes) * capacity);
+		if (NULL == palettes) {
+			ccm_runtime_error("Out of memory staging palette");
+			return;
+		}
+		current_staging->palettes = palettes;
+		current_staging->palette_capacity = capacity;
+	}
+
+	current_staging->palettes[current_staging->n_palettes++] = call;
+}
+
 static void hook_SET_PAL(CcmList lists[])
 {
 	int pal = lists[0].values[0].as.number;
@@ -144,22 +177,31 @@ static void hook_SET_PAL(CcmList lists[])
 	double r = lists[2].values[0].as.number;
 	double g = lists[3].values[0].as.number;
 	double b = lists[4].values[0].as.number;
-	set_palette_colour(pal, col, r, g, b);
+	if (NULL == current_staging) {
+		set_palette_colour(pal, col, r, g, b);
+	} else {
+		stage_palette((StagedPalette){ .palette = pal, .target = col, .r = r, .g = g, .b = b });
+	}
 }
 
 static void hook_BIND_PAL(CcmList lists[])
 {
 	int bind = lists[0].values[0].as.number;
 	int pal = lists[1].values[0].as.number;
-	bind_palette(bind, pal);
+	if (NULL == current_staging) {
+		bind_palette(bind, pal);
+	} else {
+		stage_palette((StagedPalette){ .bind = true, .palette = pal, .target = bind });
+	}
 }
 
 static void hook_SET(CcmList lists[])
 {
 	const char *name = lists[0].values[0].as.str.chars;
 	int length = lists[0].values[0].as.str.length;
-	if (state_instruction(OP_SET, name, length)) {
-		expect(state_type(name, length));
+	ValueType type = state_type(name, length);
+	if (state_instruction(type == VAL_VEC2 ? OP_SET_VEC2 : OP_SET, name, length)) {
+		expect(type);
 	} else {
 		ccm_runtime_error("Invalid variable name");
 	}
@@ -177,21 +219,21 @@ static void hook_ADD(CcmList *)
 {
 	ValueType type = expect_number_pair();
 	push(type);
-	instruction(OP_ADD);
+	instruction(type == VAL_VEC2 ? OP_ADD_VEC2 : OP_ADD);
 }
 
 static void hook_SUBTRACT(CcmList *)
 {
 	ValueType type = expect_number_pair();
 	push(type);
-	instruction(OP_SUBTRACT);
+	instruction(type == VAL_VEC2 ? OP_SUBTRACT_VEC2 : OP_SUBTRACT);
 }
 
 static void hook_MULTIPLY(CcmList *)
 {
 	ValueType type = expect_number_pair();
 	push(type);
-	instruction(OP_MULTIPLY);
+	instruction(type == VAL_VEC2 ? OP_MULTIPLY_VEC2 : OP_MULTIPLY);
 }
 
 static void hook_RAND(CcmList lists[])
@@ -217,6 +259,18 @@ static void hook_RAND_INT(CcmList lists[])
 	}
 }
 
+static void hook_DATA(CcmList lists[])
+{
+	const char *name = lists[0].values[0].as.str.chars;
+	int length = lists[0].values[0].as.str.length;
+	if (data_instruction(name, length)) {
+		expect(VAL_SCALAR);
+		push(VAL_SCALAR);
+	} else {
+		ccm_runtime_error("Invalid data table name");
+	}
+}
+
 static void hook_LESS_THAN(CcmList *)
 {
 	expect(VAL_SCALAR);
@@ -261,7 +315,7 @@ static void hook_VEC2(CcmList lists[])
 {
 	double a = lists[0].values[0].as.number;
 	double b = lists[1].values[0].as.number;
-	if (constant(double_to_vec2(a, b))) {
+	if (constant(double_to_vec2(a, b), VAL_VEC2)) {
 		push(VAL_VEC2);
 	} else {
 		ccm_runtime_error("Too many constants");
@@ -297,6 +351,42 @@ static void hook_NORMALIZE(CcmList *)
 	instruction(OP_NORMALIZE);
 }
 
+static void hook_LENGTH(CcmList *)
+{
+	expect(VAL_VEC2);
+	push(VAL_SCALAR);
+	instruction(OP_LENGTH);
+}
+
+static void hook_ATAN2(CcmList *)
+{
+	expect(VAL_VEC2);
+	push(VAL_SCALAR);
+	instruction(OP_ATAN2);
+}
+
+static void hook_ROTATE(CcmList *)
+{
+	expect(VAL_SCALAR);
+	expect(VAL_VEC2);
+	push(VAL_VEC2);
+	instruction(OP_ROTATE);
+}
+
+static void hook_SIN(CcmList *)
+{
+	expect(VAL_SCALAR);
+	push(VAL_SCALAR);
+	instruction(OP_SIN);
+}
+
+static void hook_COS(CcmList *)
+{
+	expect(VAL_SCALAR);
+	push(VAL_SCALAR);
+	instruction(OP_COS);
+}
+
 static void hook_JUMP_IF_FALSE(CcmList[])
 {
 	expect(VAL_SCALAR);
@@ -355,24 +445,57 @@ static void hook_MAP_HEIGHT(CcmList *)
 	instruction(OP_MAP_HEIGHT);
 }
 
+// Returns: whether the number is a valid sprite flag index, erroring if not
+static bool check_flag(double flag)
+{
+	if (flag < 0 || N_SPRITE_FLAGS <= flag) {
+		ccm_runtime_error("Sprite flag out of range");
+		return false;
+	}
+	return true;
+}
+
 static void hook_MAP_FLAG(CcmList lists[])
 {
-	uint8_t bit = lists[0].values[0].as.number;
+	double flag = lists[0].values[0].as.number;
 	expect(VAL_VEC2);
 	push(VAL_SCALAR);
 	instruction(OP_MAP_FLAG);
-	instruction(bit);
+	instruction(check_flag(flag) ? flag : 0);
 }
 
 static void hook_MOVE_COLLIDE(CcmList lists[])
 {
-	uint8_t bit = lists[0].values[0].as.number;
+	double flag = lists[0].values[0].as.number;
 	expect(VAL_VEC2);
 	expect(VAL_VEC2);
 	expect(VAL_VEC2);
 	push(VAL_VEC2);
 	instruction(OP_MOVE_COLLIDE);
-	instruction(bit);
+	instruction(check_flag(flag) ? flag : 0);
+}
+
+// Leaves the hit point, then its distance (or -1 on a miss)
+static void hook_RAYCAST(CcmList lists[])
+{
+	double flag = lists[0].values[0].as.number;
+	expect(VAL_VEC2);
+	expect(VAL_VEC2);
+	push(VAL_VEC2);
+	push(VAL_SCALAR);
+	instruction(OP_RAYCAST);
+	instruction(check_flag(flag) ? flag : 0);
+}
+
+// Replaces the position with a unit step towards the target
+static void hook_PATH(CcmList lists[])
+{
+	double flag = lists[0].values[0].as.number;
+	expect(VAL_VEC2);
+	expect(VAL_VEC2);
+	push(VAL_VEC2);
+	instruction(OP_PATH);
+	instruction(check_flag(flag) ? flag : 0);
 }
 
 // TODO: Argument checking
@@ -403,18 +526,55 @@ static void hook_SPRITE(CcmList lists[])
 	instruction(v_flip);
 }
 
+// Returns: whether the number is a valid entity layer, erroring if not
+static bool check_layer(double layer)
+{
+	if (layer < 0 || N_ENTITY_LAYERS <= layer) {
+		ccm_runtime_error("Entity layer out of range");
+		return false;
+	}
+	return true;
+}
+
+static void hook_ENTITY(CcmList lists[])
+{
+	double layer = lists[0].values[0].as.number;
+	expect(VAL_VEC2);
+	expect(VAL_VEC2);
+	push(VAL_SCALAR);
+	instruction(OP_ENTITY);
+	instruction(check_layer(layer) ? layer : 0);
+}
+
+static void hook_OVERLAPS(CcmList lists[])
+{
+	double layer = lists[0].values[0].as.number;
+	expect(VAL_VEC2);
+	expect(VAL_VEC2);
+	push(VAL_SCALAR);
+	instruction(OP_OVERLAPS);
+	instruction(check_layer(layer) ? layer : 0);
+}
+
+static void hook_HIT(CcmList *)
+{
+	expect(VAL_SCALAR);
+	push(VAL_SCALAR);
+	instruction(OP_HIT);
+}
+
 static void hook_DUP(CcmList *)
 {
 	ValueType top = pop();
 	push(top);
 	push(top);
-	instruction(OP_DUP);
+	instruction(top == VAL_VEC2 ? OP_DUP_VEC2 : OP_DUP);
 }
 
 static void hook_POP(CcmList *)
 {
-	pop();
-	instruction(OP_POP);
+	ValueType top = pop();
+	instruction(top == VAL_VEC2 ? OP_POP_VEC2 : OP_POP);
 }
 
 static void hook_RETURN(CcmList *)
@@ -428,7 +588,7 @@ static void save_hook_LOAD_SCALAR(CcmList lists[])
 	const char *name = lists[0].values[0].as.str.chars;
 	int length = lists[0].values[0].as.str.length;
 	const char *x = lists[1].values[0].as.str.chars;
-	set_state(scan_scalar(x), name, length);
+	set_state(scalar_to_constant(scan_scalar(x)), VAL_SCALAR, name, length);
 }
 
 static void save_hook_LOAD_VEC2(CcmList lists[])
@@ -437,14 +597,18 @@ static void save_hook_LOAD_VEC2(CcmList lists[])
 	int length = lists[0].values[0].as.str.length;
 	const char *x = lists[1].values[0].as.str.chars;
 	const char *y = lists[2].values[0].as.str.chars;
-	set_state(scan_vec2(x, y), name, length);
+	set_state(scan_vec2(x, y), VAL_VEC2, name, length);
 }
 
-static bool parse_update_impl(const char *src, int src_length, const char *predef_src, int predef_length, int initial_line)
+// Registers primitives and compiles predefs.ccm, keeping both in Crocomacs
+// Returns: success
+static bool load_predefs(time_t timestamp)
 {
 #define TRY(name, arg_count) \
 	if (!ccm_define_primitive(#name, sizeof(#name) - 1, arg_count, hook_ ## name)) return false
 
+	ccm_cleanup();
+	predefs_timestamp = MODIFY_ERROR;
 	ccm_set_logger(gvm_error);
 	ccm_set_allocators(gvm_malloc, gvm_ccm_realloc_wrapper, gvm_free);
 	ccm_set_number_hook(hook_number);
@@ -462,6 +626,7 @@ static bool parse_update_impl(const char *src, int src_length, const char *prede
 	TRY(MODULO, 0);
 	TRY(RAND, 1);
 	TRY(RAND_INT, 1);
+	TRY(DATA, 1);
 	TRY(LESS_THAN, 0);
 	TRY(GREATER_THAN, 0);
 	TRY(NOT, 0);
@@ -473,6 +638,11 @@ static bool parse_update_impl(const char *src, int src_length, const char *prede
 	TRY(GET_X, 0);
 	TRY(GET_Y, 0);
 	TRY(NORMALIZE, 0);
+	TRY(LENGTH, 0);
+	TRY(ATAN2, 0);
+	TRY(ROTATE, 0);
+	TRY(SIN, 0);
+	TRY(COS, 0);
 	TRY(JUMP_IF_FALSE, 0);
 	TRY(JUMP_AND_POP, 0);
 	TRY(POP_JUMP, 0);
@@ -481,343 +651,861 @@ static bool parse_update_impl(const char *src, int src_length, const char *prede
 	TRY(MAP_HEIGHT, 0);
 	TRY(MAP_FLAG, 1);
 	TRY(MOVE_COLLIDE, 1);
+	TRY(RAYCAST, 1);
+	TRY(PATH, 1);
 	TRY(FILL_RECT, 2);
 	TRY(SPRITE, 5);
+	TRY(ENTITY, 1);
+	TRY(OVERLAPS, 1);
+	TRY(HIT, 0);
 	TRY(DUP, 0);
 	TRY(POP, 0);
 	TRY(RETURN, 0);
 
-	if (!ccm_execute(predef_src, predef_length, 1)) {
+	// TODO: Not sure if keeping them in a file is necessary/helpful
+	FileView predefs;
+	if (!read_file_executable("predefs.ccm", &predefs)) {
+		gvm_error("Could not read predefs.ccm: aborting\n");
 		return false;
 	}
 
-	return ccm_execute(src, src_length, initial_line);
+	// Predefs only define macros, so there's nothing to run
+	bool success = ccm_compile(predefs.chars, predefs.length, 1) && ccm_keep_macros();
+	close_file_view(&predefs);
+	if (success) {
+		predefs_timestamp = timestamp;
+	}
+	return success;
 
 #undef TRY
 }
 
 static bool parse_update(const char *src, int src_length, int initial_line)
 {
-	// TODO: Not sure if keeping them in a file is necessary/helpful
-	int predef_length;
-	char *predef_src = read_file_executable("predefs.ccm", &predef_length);
-	if (NULL == predef_src) {
-		gvm_error("Could not read predefs.ccm: aborting\n");
-		return false;
+	time_t timestamp = last_modified_executable("predefs.ccm");
+	if (MODIFY_ERROR == timestamp || timestamp != predefs_timestamp) {
+		if (!load_predefs(timestamp)) {
+			return false;
+		}
 	}
 
-	bool success = parse_update_impl(src, src_length, predef_src, predef_length, initial_line);
-	ccm_cleanup();
-	gvm_free(predef_src);
+	bool success = ccm_execute(src, src_length, initial_line);
+	ccm_forget_macros();
 	return success;
 }
 
-// Returns: number of characters until newline or null terminator
-static int line_length(const char *chars)
+// A line of the ROM, not counting its newline
+typedef struct {
+	const char *chars;
+	int length;
+} RomLine;
+
+// SPRITE and MAP are decoded on worker threads while UPDATE parses, then
+// committed to the VM and renderer in order on the main thread. A worker
+// keeps its error to be reported then, so output is as if parsed in order.
+typedef struct SectionJob {
+	bool (*decode)(struct SectionJob *job);
+	const RomLine *lines;
+	int n_lines;
+	pthread_t thread;
+	bool threaded;
+	bool success;
+	char error[256];
+	// Geometry of the sprite sheet, which the map's cells are encoded for
+	int sheet_cols;
+	int sheet_rows;
+	// SPRITE
+	uint8_t *sprite_data; // [n_rows][SPRITE_SZ][SPRITE_SZ * sheet_cols]
+	int n_rows;
+	// Indexed by column + row * SPRITE_MAX_COLS, like the VM's
+	uint8_t sprite_flags[SPRITE_MAX_ROWS * SPRITE_MAX_COLS];
+	uint8_t sprite_shapes[SPRITE_MAX_ROWS * SPRITE_MAX_COLS];
+	// MAP
+	uint8_t (*map)[4];
+	int width;
+	int height;
+} SectionJob;
+
+// Splits src into lines in a single pass
+// Returns: every line (caller frees), or NULL on failure; places count in
+// out_count
+static RomLine *index_lines(const char *src, int src_length, int *out_count)
 {
-	const char *newline = strchr(chars, '\n');
-	if (newline != NULL) {
-		return newline - chars;
-	} else {
-		return strlen(chars);
+	int capacity = 256;
+	int count = 0;
+	RomLine *lines = gvm_malloc(sizeof(RomLine) * capacity);
+	if (NULL == lines) {
+		return NULL;
+	}
+
+	const char *head = src;
+	const char *end = &src[src_length];
+	while (true) {
+		if (count >= capacity) {
+			RomLine *grown = gvm_realloc(lines, sizeof(RomLine) * capacity, sizeof(RomLine) * capacity * 2);
+			if (NULL == grown) {
+				gvm_free(lines);
+				return NULL;
+			}
+			lines = grown;
+			capacity *= 2;
+		}
+
+		const char *newline = memchr(head, '\n', end - head);
+		lines[count].chars = head;
+		lines[count].length = (NULL == newline ? end : newline) - head;
+		++count;
+		if (NULL == newline) {
+			break;
+		}
+		head = newline + 1;
 	}
+
+	*out_count = count;
+	return lines;
 }
 
-// Returns: pointer to just after the next newline in str, or NULL if none
-static const char *next_line(const char *str)
+// Returns: index of the first of lines [first, n_lines) that is 'header',
+// alone or followed by a space and arguments, or -1 if none is
+static int find_header(const RomLine *lines, int first, int n_lines, const char *header)
 {
-	const char *line_end = strchr(str, '\n');
-	if (line_end == NULL) {
-		return NULL;
-	} else {
-		return ++line_end;
+	int length = strlen(header);
+	for (int i = first; i < n_lines; ++i) {
+		if (lines[i].length >= length && 0 == memcmp(lines[i].chars, header, length)
+			&& (lines[i].length == length || ' ' == lines[i].chars[length])) {
+			return i;
+		}
 	}
+	return -1;
 }
 
-// Returns: line number of 'end' relative to 'start', beginning at 1
-// Does no error-checking - ensure arguments are valid
-static int line_number(const char *start, const char *end)
+// Reads the sprite sheet's geometry from the arguments of its header line,
+// " <columns>x<rows>", or gives the default if there are none
+// Returns: success
+static bool sprite_geometry(const RomLine *header_line, int header_length, int *out_cols, int *out_rows)
 {
-	int line = 0;
-	const char *head = start;
-	while (head <= end) {
-		head = next_line(head);
-		++line;
+	*out_cols = SPRITE_DEFAULT_COLS;
+	*out_rows = SPRITE_DEFAULT_ROWS;
+	int length = header_line->length - header_length;
+	if (0 == length) {
+		return true;
+	}
+
+	char args[32];
+	int cols;
+	int rows;
+	int consumed = 0;
+	if (length < sizeof(args)) {
+		memcpy(args, &header_line->chars[header_length], length);
+		args[length] = '\0';
+		sscanf(args, " %dx%d%n", &cols, &rows, &consumed);
 	}
-	return line;
+	if (consumed != length) {
+		gvm_error("Sprite: expect geometry as '<columns>x<rows>'\n");
+		return false;
+	} else if (cols < 1 || cols > SPRITE_MAX_COLS || rows < 1 || rows > SPRITE_MAX_ROWS) {
+		gvm_error("Sprite: geometry must be between 1x1 and %dx%d\n", SPRITE_MAX_COLS, SPRITE_MAX_ROWS);
+		return false;
+	}
+
+	*out_cols = cols;
+	*out_rows = rows;
+	return true;
 }
 
-// Searches 'src' for a full line matching 'line' exactly, terminated by a
-// newline or the end of the string
-// Returns: start of line, or NULL if not found
-static const char *find_line(const char *str, const char *line)
+static bool is_blank(char c)
 {
-	int length = strlen(line);
-	const char *location = strstr(str, line);
-	while (location != NULL && str != NULL) {
-		char term = location[length];
-		if ((term == '\n' || term == '\0') && (location == str || location[-1] == '\n')) {
-			return location;
+	return ' ' == c || '\t' == c;
+}
+
+// Reads a decimal number, '-'? digits ('.' digits)?, straight to fixed point,
+// dropping digits past its resolution
+// Returns: characters read, or 0 if there's no number or it's out of range
+static int scan_data_value(const char *chars, int length, FixedPoint *out)
+{
+	int i = 0;
+	bool negative = i < length && '-' == chars[i];
+	i += negative;
+
+	int64_t whole = 0;
+	int n_digits = 0;
+	for (; i < length && chars[i] >= '0' && chars[i] <= '9'; ++i, ++n_digits) {
+		whole = whole * 10 + (chars[i] - '0');
+		if (whole > FP_MAX / FP_DEN) {
+			return 0;
 		}
-		str = next_line(location);
-		location = strstr(str, line);
 	}
 
-	return NULL;
+	int64_t fraction = 0;
+	if (i < length && '.' == chars[i]) {
+		int64_t place = FP_DEN;
+		for (++i; i < length && chars[i] >= '0' && chars[i] <= '9'; ++i, ++n_digits) {
+			place /= 10;
+			fraction += (chars[i] - '0') * place;
+		}
+	}
+
+	// The whole part alone can be in range with the fraction taking it out
+	int64_t value = whole * FP_DEN + fraction;
+	if (0 == n_digits || value > FP_MAX) {
+		return 0;
+	}
+	*out = negative ? -value : value;
+	return i;
 }
 
-static bool parse_sprite(const char *src, int src_length)
+// Reads DATA into the VM, a table a line: its name, then its values, all
+// separated by blanks. Blank lines are skipped.
+// Returns: success
+static bool parse_data(const RomLine *lines, int n_lines)
 {
+	// Values take at least two characters each, with the blank before them
+	int max_length = 0;
+	for (int line = 0; line < n_lines; ++line) {
+		max_length = lines[line].length > max_length ? lines[line].length : max_length;
+	}
+	FixedPoint *values = gvm_malloc(sizeof(*values) * (max_length / 2 + 1));
+	if (NULL == values) {
+		return false;
+	}
+
+	bool success = true;
+	for (int line = 0; line < n_lines && success; ++line) {
+		const char *chars = lines[line].chars;
+		int length = lines[line].length;
+		int i = 0;
+		while (i < length && is_blank(chars[i])) {
+			++i;
+		}
+		if (i == length) {
+			continue;
+		}
+
+		const char *name = &chars[i];
+		while (i < length && !is_blank(chars[i])) {
+			++i;
+		}
+		int name_length = &chars[i] - name;
+
+		uint32_t count = 0;
+		while (success) {
+			while (i < length && is_blank(chars[i])) {
+				++i;
+			}
+			if (i == length) {
+				break;
+			}
+
+			int read = scan_data_value(&chars[i], length - i, &values[count++]);
+			i += read;
+			if (0 == read || (i < length && !is_blank(chars[i]))) {
+				gvm_error("Data: invalid value in table '%.*s'\n", name_length, name);
+				success = false;
+			}
+		}
+
+		if (success && 0 == count) {
+			gvm_error("Data: table '%.*s' has no values\n", name_length, name);
+			success = false;
+		} else if (success && !define_data(name, name_length, values, count)) {
+			gvm_error("Data: could not define table '%.*s' (defined twice, or over 256 tables)\n", name_length, name);
+			success = false;
+		}
+	}
+
+	gvm_free(values);
+	return success;
+}
+
+// Map cells are a column letter and a row number, with a third digit if the
+// sheet has the rows to need it. Cells of flags are as long, and end in the
+// flips.
+static int map_cell_length(int sheet_rows)
+{
+	return sheet_rows > 100 ? 4 : 3;
+}
+
+// Character classes, as value + 1 so that 0 marks anything else. Converting
+// a line is then one lookup a character, OR-ing (value - 1) together: any bad
+// character sets the top bit, and the line is rescanned for it only then.
+static const uint8_t sprite_pixels[256] = { [' '] = 1, ['.'] = 2, ['o'] = 3 };
+static const uint8_t sprite_flag_bits[256] = { [' '] = 1, ['1'] = 2 };
+static const uint8_t sprite_shapes[256] = {
+	[' '] = SHAPE_FULL + 1,
+	['/'] = SHAPE_SLOPE_UP + 1,
+	['\\'] = SHAPE_SLOPE_DOWN + 1,
+	['_'] = SHAPE_BOTTOM_HALF + 1,
+	['-'] = SHAPE_TOP_HALF + 1,
+	['^'] = SHAPE_ONE_WAY + 1,
+};
+static const uint8_t map_columns[256] = {
+	['a'] = 1, ['b'] = 2, ['c'] = 3, ['d'] = 4, ['e'] = 5, ['f'] = 6, ['g'] = 7,
+	['h'] = 8, ['i'] = 9, ['j'] = 10, ['k'] = 11, ['l'] = 12, ['m'] = 13,
+	['n'] = 14, ['o'] = 15, ['p'] = 16, ['q'] = 17, ['r'] = 18, ['s'] = 19,
+	['t'] = 20, ['u'] = 21, ['v'] = 22, ['w'] = 23, ['x'] = 24, ['y'] = 25,
+	['z'] = 26,
+};
+static const uint8_t map_digits[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+};
+static const uint8_t map_spaces[256] = { [' '] = 1 };
+static const uint8_t map_h_flips[256] = { [' '] = 1, ['h'] = 2 };
+static const uint8_t map_v_flips[256] = { [' '] = 1, ['v'] = 2 };
+
+#define CLASSIFY(table, c) ((uint8_t)((table)[(uint8_t)(c)] - 1))
+#define CLASS_INVALID 0x80
+
+// Returns: first character of chars not in the table
+static char first_invalid(const uint8_t *table, const char *chars, int length, int stride)
+{
+	for (int i = 0; i < length; i += stride) {
+		if (0 == table[(uint8_t)chars[i]]) {
+			return chars[i];
+		}
+	}
+	return '\0';
+}
+
+// Keeps the first error of a job
+static void job_error(SectionJob *job, const char *format, ...)
+{
+	if (job->error[0] != '\0') {
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	vsnprintf(job->error, sizeof(job->error), format, args);
+	va_end(args);
+}
+
+// Decodes rows of sprites and their flags
+// Returns: success
+static bool decode_sprite(SectionJob *job)
+{
+	const RomLine *lines = job->lines;
+	int n_lines = job->n_lines;
+	int cols = job->sheet_cols;
+	job->sprite_data = gvm_malloc(job->sheet_rows * SPRITE_SZ * SPRITE_SZ * cols);
+	if (NULL == job->sprite_data) {
+		return false;
+	}
+
 	// Skip empty lines
-	const char *tapehead = src;
-	const char *end = &src[src_length];
-	while (tapehead < end && tapehead != NULL && line_length(tapehead) == 0) {
-		tapehead = next_line(tapehead);
+	int line = 0;
+	while (line < n_lines && 0 == lines[line].length) {
+		++line;
 	}
 
 	int n_rows = 0;
-	while (tapehead < end && tapehead != NULL && line_length(tapehead) > 0) {
+	while (line < n_lines && lines[line].length > 0) {
+		if (n_rows >= job->sheet_rows) {
+			job_error(job, "Maximum of %d rows of sprites exceeded\n", job->sheet_rows);
+			return false;
+		}
+
 		// Consume a row of sprites
-		uint8_t render_data[SPRITE_SZ * SPRITE_SZ * SPRITE_COLS];
-		for (int i = 0; i < SPRITE_SZ; ++i) {
-			if (tapehead >= end || tapehead == NULL) {
-				gvm_error("Sprite: incomplete row\n");
+		for (int i = 0; i < SPRITE_SZ; ++i, ++line) {
+			if (line >= n_lines) {
+				job_error(job, "Sprite: incomplete row\n");
 				return false;
 			}
 
-			if (line_length(tapehead) != SPRITE_SZ * SPRITE_COLS) {
-				gvm_error("Sprite: improper line length\n");
+			if (lines[line].length != SPRITE_SZ * cols) {
+				job_error(job, "Sprite: improper line length\n");
 				return false;
 			}
 
-			for (int j = 0; j < SPRITE_SZ * SPRITE_COLS; ++j) {
-				char c = tapehead[j];
-				uint8_t *target = &render_data[i * SPRITE_SZ * SPRITE_COLS + j];
-				if (' ' == c) {
-					*target = 0;
-				} else if ('.' == c) {
-					*target = 1;
-				} else if ('o' == c) {
-					*target = 2;
-				} else {
-					gvm_error("Sprite: unexpected character '%c'\n", c);
-					return false;
-				}
+			const char *chars = lines[line].chars;
+			uint8_t *target = &job->sprite_data[(n_rows * SPRITE_SZ + i) * SPRITE_SZ * cols];
+			uint8_t classes = 0;
+			for (int j = 0; j < SPRITE_SZ * cols; ++j) {
+				target[j] = CLASSIFY(sprite_pixels, chars[j]);
+				classes |= target[j];
+			}
+			if (classes & CLASS_INVALID) {
+				job_error(job, "Sprite: unexpected character '%c'\n", first_invalid(sprite_pixels, chars, SPRITE_SZ * cols, 1));
+				return false;
 			}
-
-			tapehead = next_line(tapehead);
-		}
-
-		// Give data to renderer
-		// TODO: Right now this isn't atomic (if some or all rows succeed before
-		// a failure, those sprites will show their new appearance anyway). This
-		// is inconsistent with atomicity in the VM.
-		if (!define_sprite_row(render_data, n_rows)) {
-			return false;
 		}
 
 		// Consume flags
-		if (tapehead >= end || tapehead == NULL) {
-			gvm_error("Sprite: missing flag row\n");
+		if (line >= n_lines) {
+			job_error(job, "Sprite: missing flag row\n");
 			return false;
 		}
 
-		if (line_length(tapehead) != SPRITE_SZ * SPRITE_COLS) {
-			gvm_error("Sprite: flag row improper line length\n");
+		if (lines[line].length != SPRITE_SZ * cols) {
+			job_error(job, "Sprite: flag row improper line length\n");
 			return false;
 		}
 
-		for (int i = 0; i < SPRITE_COLS; ++i) {
+		for (int i = 0; i < cols; ++i) {
+			const char *chars = &lines[line].chars[i * SPRITE_SZ];
 			uint8_t flags = 0;
+			uint8_t classes = 0;
 			for (int j = 0; j < N_SPRITE_FLAGS; ++j) {
-				char c = tapehead[i * SPRITE_SZ + j];
-				if (' ' == c) {
-					continue;
-				} else if ('1' == c) {
-					flags |= 1u << j;
-				} else {
-					gvm_error("Sprite: flag row unexpected character '%c'\n", c);
-					return false;
-				}
+				uint8_t bit = CLASSIFY(sprite_flag_bits, chars[j]);
+				flags |= bit << j;
+				classes |= bit;
+			}
+			if (classes & CLASS_INVALID) {
+				job_error(job, "Sprite: flag row unexpected character '%c'\n", first_invalid(sprite_flag_bits, chars, N_SPRITE_FLAGS, 1));
+				return false;
 			}
 
-			set_sprite_flags(flags, n_rows * SPRITE_COLS + i);
+			// Then the collision shape, full unless given
+			uint8_t shape = CLASSIFY(sprite_shapes, chars[N_SPRITE_FLAGS]);
+			if (shape & CLASS_INVALID) {
+				job_error(job, "Sprite: flag row unexpected shape '%c'\n", chars[N_SPRITE_FLAGS]);
+				return false;
+			}
+
+			job->sprite_flags[n_rows * SPRITE_MAX_COLS + i] = flags;
+			job->sprite_shapes[n_rows * SPRITE_MAX_COLS + i] = shape;
 		}
 
-		tapehead = next_line(tapehead);
+		++line;
 		++n_rows;
 	}
 
+	job->n_rows = n_rows;
 	return true;
 }
 
-static bool parse_map(const char *src, int src_length)
+// The renderer is only given the sprites once they've all parsed, so a
+// failure leaves it as it was
+static bool commit_sprite(SectionJob *job)
 {
-	const char *end = &src[src_length];
-	const char *tapehead = src;
-	int width = 0;
-	int height = 0;
+	// Sprites the sheet doesn't have were zeroed with the job, to no flags and
+	// SHAPE_FULL: the VM may still have flags from a previous sprite sheet
+	for (int i = 0; i < SPRITE_MAX_ROWS * SPRITE_MAX_COLS; ++i) {
+		set_sprite_flags(job->sprite_flags[i], i);
+		set_sprite_shape(job->sprite_shapes[i], i);
+	}
+
+	if (NULL != current_staging) {
+		current_staging->sprite_data = job->sprite_data;
+		current_staging->n_rows = job->n_rows;
+		current_staging->sheet_cols = job->sheet_cols;
+		current_staging->sheet_rows = job->sheet_rows;
+		job->sprite_data = NULL;
+		return true;
+	}
+	return define_sprite_rows(job->sprite_data, job->n_rows, job->sheet_cols, job->sheet_rows);
+}
+
+// Reports the first fault in a map line pair that failed to convert, in the
+// order the checks are listed in
+static void map_line_error(SectionJob *job, const RomLine *coords, const RomLine *flags, int width, int cell)
+{
+	for (int j = 0; j < width; ++j) {
+		const char *tile = &coords->chars[j * cell];
+		if (CLASSIFY(map_columns, tile[0]) >= job->sheet_cols) {
+			job_error(job, "Map: unexpected character '%c' (expect between 'a' and '%c')\n", tile[0], 'a' + job->sheet_cols - 1);
+			return;
+		}
+		int row = 0;
+		for (int k = 1; k < cell; ++k) {
+			if (0 == map_digits[(uint8_t)tile[k]]) {
+				job_error(job, "Map: invalid column number\n");
+				return;
+			}
+			row = row * 10 + CLASSIFY(map_digits, tile[k]);
+		}
+		if (row >= job->sheet_rows) {
+			job_error(job, "Map: row %d is off the sprite sheet\n", row);
+			return;
+		}
+	}
+
+	for (int j = 0; j < width; ++j) {
+		const char *tile = &flags->chars[j * cell];
+		for (int k = 0; k < cell - 2; ++k) {
+			if (0 == map_spaces[(uint8_t)tile[k]]) {
+				job_error(job, "Map: expect empty space\n");
+				return;
+			}
+		}
+		if (0 == map_h_flips[(uint8_t)tile[cell - 2]]) {
+			job_error(job, "Map: expect ' ' or 'h'\n");
+			return;
+		} else if (0 == map_v_flips[(uint8_t)tile[cell - 1]]) {
+			job_error(job, "Map: expect ' ' or 'v'\n");
+			return;
+		}
+	}
+}
+
+// Decodes the map, leaving job->map NULL if it's empty
+// Returns: success
+static bool decode_map(SectionJob *job)
+{
+	const RomLine *lines = job->lines;
+	int n_lines = job->n_lines;
 
 	// Skip empty lines
-	while (tapehead < end && tapehead != NULL && line_length(tapehead) == 0) {
-		tapehead = next_line(tapehead);
+	int first = 0;
+	while (first < n_lines && 0 == lines[first].length) {
+		++first;
 	}
 
 	// Special case: empty
-	if (tapehead >= end || NULL == tapehead) {
-		return register_map(NULL, 0, 0);
+	if (first >= n_lines) {
+		return true;
 	}
 
 	// Special (bad) case
-	if (line_length(tapehead) % 3 != 0) {
-		gvm_error("Malformed map\n");
+	int cell = map_cell_length(job->sheet_rows);
+	if (lines[first].length % cell != 0) {
+		job_error(job, "Malformed map\n");
 		return false;
 	}
 
 	// Scan for width + height
-	const char *map_start = tapehead;
-	width = line_length(tapehead) / 3;
-	while (tapehead < end && tapehead != NULL && line_length(tapehead) > 0) {
-		if (line_length(tapehead) != width * 3) {
-			gvm_error("Map: incomplete line of sprite coordinates\n");
+	int width = lines[first].length / cell;
+	int height = 0;
+	for (int line = first; line < n_lines && lines[line].length > 0; line += 2) {
+		if (lines[line].length != width * cell) {
+			job_error(job, "Map: incomplete line of sprite coordinates\n");
 			return false;
 		}
-		tapehead = next_line(tapehead);
 
-		if (tapehead >= end || NULL == tapehead || line_length(tapehead) != width * 3) {
-			gvm_error("Map: incomplete line of sprite flags\n");
+		if (line + 1 >= n_lines || lines[line + 1].length != width * cell) {
+			job_error(job, "Map: incomplete line of sprite flags\n");
 			return false;
 		}
-		tapehead = next_line(tapehead);
 		++height;
 	}
 
-	tapehead = map_start;
 	// TODO: Using 2D array here might cause more confusion than it clarifies
 	uint8_t (*map)[4] = gvm_malloc(sizeof(map[0]) * width * height);
 	if (map == NULL) {
 		return false;
 	}
+	job->map = map;
+	job->width = width;
+	job->height = height;
 
-	// Fully parse
+	// Fully parse: coordinates, then flags. Cells off the sheet are caught by
+	// the line's highest column and row.
 	for (int i = 0; i < height; ++i) {
-		// Coordinates...
+		const RomLine *coords = &lines[first + 2 * i];
+		const RomLine *flags = &lines[first + 2 * i + 1];
+		uint8_t classes = 0;
+		uint8_t top_column = 0;
+		int top_row = 0;
 		for (int j = 0; j < width; ++j) {
-			char row = tapehead[j * 3];
-			map[i * width + j][0] = row - 'a';
-			if (row < 'a' || 'g' < row) {
-				gvm_error("Map: unexpected character '%c' (expect between 'a' and 'g')\n", row);
-				gvm_free(map);
-				return false;
-			}
-
-			// Parse y-coord manually - atoi() causes more problems than it solves
-			char c0 = tapehead[j * 3 + 1];
-			char c1 = tapehead[j * 3 + 2];
-			map[i * width + j][1] = (c0 - '0') * 10 + (c1 - '0');
-			if (c0 < '0' || '9' < c0 || c1 < '0' || '9' < c1) {
-				gvm_error("Map: invalid column number\n");
-				gvm_free(map);
-				return false;
+			const char *tile = &coords->chars[j * cell];
+			uint8_t column = CLASSIFY(map_columns, tile[0]);
+			int row = 0;
+			for (int k = 1; k < cell; ++k) {
+				uint8_t digit = CLASSIFY(map_digits, tile[k]);
+				classes |= digit;
+				row = row * 10 + digit;
 			}
+			classes |= column;
+			top_column = column > top_column ? column : top_column;
+			top_row = row > top_row ? row : top_row;
+			map[i * width + j][0] = column;
+			map[i * width + j][1] = row;
 		}
-		tapehead = next_line(tapehead);
-
-		// Flags...
 		for (int j = 0; j < width; ++j) {
-			if (tapehead[j * 3] != ' ') {
-				gvm_error("Map: expect empty space\n");
-				gvm_free(map);
-				return false;
+			const char *tile = &flags->chars[j * cell];
+			for (int k = 0; k < cell - 2; ++k) {
+				classes |= CLASSIFY(map_spaces, tile[k]);
 			}
+			uint8_t h = CLASSIFY(map_h_flips, tile[cell - 2]);
+			uint8_t v = CLASSIFY(map_v_flips, tile[cell - 1]);
+			classes |= h | v;
+			map[i * width + j][2] = h;
+			map[i * width + j][3] = v;
+		}
 
-			char h = tapehead[j * 3 + 1];
-			map[i * width + j][2] = ('h' == h);
-			if (' ' != h && 'h' != h) {
-				gvm_error("Map: expect ' ' or 'h'\n");
-				gvm_free(map);
-				return false;
-			}
+		if ((classes & CLASS_INVALID) || top_column >= job->sheet_cols || top_row >= job->sheet_rows) {
+			map_line_error(job, coords, flags, width, cell);
+			return false;
+		}
+	}
 
-			char v = tapehead[j * 3 + 2];
-			map[i * width + j][3] = ('v' == v);
-			if (' ' != v && 'v' != v) {
-				gvm_error("Map: expect ' ' or 'v'\n");
-				gvm_free(map);
-				return false;
-			}
+	return true;
+}
+
+static bool commit_map(SectionJob *job)
+{
+	if (NULL != current_staging) {
+		// The VM side still happens here, off the main thread
+		current_staging->has_map = true;
+		current_staging->map_width = job->width;
+		current_staging->map_height = job->height;
+		if (NULL == job->map) {
+			return true;
 		}
-		tapehead = next_line(tapehead);
+		current_staging->map = job->map;
+		job->map = NULL;
+		return set_introspection_map(current_staging->map, current_staging->map_width, current_staging->map_height);
 	}
 
-	// TODO: Renderer atomicity - see define_sprite_row()
-	bool success = register_map(map, width, height);
-	bool vm_success = set_introspection_map(map, width, height);
-	gvm_free(map);
+	if (NULL == job->map) {
+		return register_map(NULL, 0, 0);
+	}
+
+	// TODO: Renderer atomicity - if this fails, the renderer keeps the sprites
+	// (and maybe the map) of a ROM the VM has rejected
+	bool success = register_map(job->map, job->width, job->height);
+	bool vm_success = set_introspection_map(job->map, job->width, job->height);
 	return success && vm_success;
 }
 
+static void *run_job(void *job)
+{
+	SectionJob *section = job;
+	section->success = section->decode(section);
+	return NULL;
+}
+
+// Decodes lines on a worker thread, or right away if there's only one CPU or
+// a thread can't be started
+static void start_job(SectionJob *job, bool (*decode)(SectionJob *), const RomLine *lines, int n_lines, int sheet_cols, int sheet_rows)
+{
+	memset(job, 0, sizeof(*job));
+	job->decode = decode;
+	job->lines = lines;
+	job->n_lines = n_lines;
+	job->sheet_cols = sheet_cols;
+	job->sheet_rows = sheet_rows;
+	job->threaded = gvm_cpu_count() > 1 && 0 == pthread_create(&job->thread, NULL, run_job, job);
+	if (!job->threaded) {
+		run_job(job);
+	}
+}
+
+// Waits for the job, reporting its error if it failed
+// Returns: success
+static bool finish_job(SectionJob *job, bool report)
+{
+	if (job->threaded) {
+		pthread_join(job->thread, NULL);
+		job->threaded = false;
+	}
+	if (!job->success && report && job->error[0] != '\0') {
+		gvm_error("%s", job->error);
+	}
+	return job->success;
+}
+
+static void free_job(SectionJob *job)
+{
+	gvm_free(job->sprite_data);
+	gvm_free(job->map);
+}
+
+#undef CLASSIFY
+#undef CLASS_INVALID
+
+// Returns: a hash of the bytes, to tell whether a section has changed
+static uint64_t hash_bytes(const char *bytes, size_t length)
+{
+	// FNV-1a, a word at a time
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, &bytes[i], sizeof(word));
+		hash = (hash ^ word) * UINT64_C(0x100000001b3);
+		hash ^= hash >> 32;
+	}
+	for (; i < length; ++i) {
+		hash = (hash ^ (uint8_t)bytes[i]) * UINT64_C(0x100000001b3);
+	}
+	return hash ^ length;
+}
+
 bool load_rom(const char *path)
+{
+	uint8_t parsed;
+	return reload_rom(path, ROM_ALL_SECTIONS, &parsed, NULL);
+}
+
+// Sections are parsed into the VM and renderer as they are, so a caller
+// reloading into a fresh VM must carry over what wasn't parsed itself.
+// The map is baked from the sprites, so it's parsed whenever they are.
+// Off the main thread, renderer calls go into a zeroed out_staging instead,
+// which the caller must commit or free either way. Only one reload may run
+// at a time, and not alongside load_state().
+bool reload_rom(const char *path, uint8_t force, uint8_t *out_parsed, RomStaging *out_staging)
 {
 	jump_count = 0;
 	stack_count = 0;
+	*out_parsed = 0;
 
-	int src_length;
-	char *src = read_file(path, &src_length);
-	if (NULL == src) {
+	// Copied rather than mapped: the ROM is watched for edits, and an editor
+	// truncating it mid-parse would fault a mapping
+	FileView file;
+	if (!read_file_copied(path, &file)) {
 		gvm_error("Could not read %s: aborting\n", path);
 		return false;
 	}
+	const char *src = file.chars;
+	int src_length = file.length;
+
+	// Every line is found once, up front, and sections are runs of them
+	int n_lines;
+	RomLine *lines = index_lines(src, src_length, &n_lines);
+	if (NULL == lines) {
+		close_file_view(&file);
+		return false;
+	}
 
-	// TODO: Clean up/generalise
 	const char header_update[] = "🐊 UPDATE";
-	const char *line_update = find_line(src, header_update);
-	if (line_update != src) { // required to be first line
+	if (find_header(lines, 0, 1, header_update) != 0) { // required to be first line
 		gvm_error("Expect '%s'\n", header_update);
-		gvm_free(src);
+		gvm_free(lines);
+		close_file_view(&file);
 		return false;
 	}
-	const char *chars_update = next_line(line_update);
 
 	const char header_sprite[] = "🐊 SPRITE";
-	const char *line_sprite = find_line(chars_update, header_sprite);
-	if (line_sprite == NULL) {
+	int line_sprite = find_header(lines, 1, n_lines, header_sprite);
+	if (line_sprite < 0) {
 		gvm_error("Expect '%s'\n", header_sprite);
-		gvm_free(src);
+		gvm_free(lines);
+		close_file_view(&file);
+		return false;
+	}
+
+	int sheet_cols;
+	int sheet_rows;
+	if (!sprite_geometry(&lines[line_sprite], strlen(header_sprite), &sheet_cols, &sheet_rows)) {
+		gvm_free(lines);
+		close_file_view(&file);
 		return false;
 	}
-	const char *chars_sprite = next_line(line_sprite);
 
 	const char header_map[] = "🐊 MAP";
-	const char *line_map = find_line(chars_sprite, header_map);
-	if (line_map == NULL) {
+	int line_map = find_header(lines, line_sprite + 1, n_lines, header_map);
+	if (line_map < 0) {
 		gvm_error("Expect '%s'\n", header_map);
-		gvm_free(src);
+		gvm_free(lines);
+		close_file_view(&file);
 		return false;
 	}
-	const char *chars_map = next_line(line_map);
 
-	int length_update = line_sprite - chars_update;
-	int length_sprite = line_map - chars_sprite;
-	int length_map = &src[src_length] - chars_map;
+	const char header_data[] = "🐊 DATA";
+	int line_data = find_header(lines, line_map + 1, n_lines, header_data);
+	int end_map = line_data < 0 ? n_lines : line_data;
 
-	if (!parse_update(chars_update, length_update, line_number(src, chars_update))) {
-		gvm_free(src);
+	if (lines[0].length != strlen(header_update) || lines[line_map].length != strlen(header_map)
+		|| (line_data >= 0 && lines[line_data].length != strlen(header_data))) {
+		gvm_error("Expect no arguments to '%s', '%s' or '%s'\n", header_update, header_map, header_data);
+		gvm_free(lines);
+		close_file_view(&file);
 		return false;
 	}
 
-	if (!parse_sprite(chars_sprite, length_sprite)) {
-		gvm_free(src);
-		return false;
+	// Each section runs from the line after its header to the next header,
+	// but SPRITE takes in its header, which has the sheet's geometry. Without
+	// DATA, it's empty.
+	const char *end = &src[src_length];
+	const char *section_start[N_ROM_SECTIONS] = {
+		lines[1].chars,
+		lines[line_sprite].chars,
+		line_map + 1 < n_lines ? lines[line_map + 1].chars : end,
+		line_data >= 0 && line_data + 1 < n_lines ? lines[line_data + 1].chars : end,
+	};
+	const char *section_end[N_ROM_SECTIONS] = {
+		lines[line_sprite].chars,
+		lines[line_map].chars,
+		line_data >= 0 ? lines[line_data].chars : end,
+		end,
+	};
+	uint64_t hashes[N_ROM_SECTIONS];
+	uint8_t parse = force;
+	for (int i = 0; i < N_ROM_SECTIONS; ++i) {
+		hashes[i] = hash_bytes(section_start[i], section_end[i] - section_start[i]);
+		if (!have_section_hashes || hashes[i] != section_hashes[i]) {
+			parse |= 1u << i;
+		}
+	}
+	if (parse & ROM_SECTION_SPRITE) {
+		parse |= ROM_SECTION_MAP;
+	}
+	// Code refers to DATA's tables by index
+	if (parse & (ROM_SECTION_UPDATE | ROM_SECTION_DATA)) {
+		parse |= ROM_SECTION_UPDATE | ROM_SECTION_DATA;
 	}
 
-	if (!parse_map(chars_map, length_map)) {
-		gvm_free(src);
-		return false;
+	current_staging = out_staging;
+	SectionJob sprite_job;
+	SectionJob map_job;
+	if (parse & ROM_SECTION_SPRITE) {
+		start_job(&sprite_job, decode_sprite, &lines[line_sprite + 1], line_map - line_sprite - 1, sheet_cols, sheet_rows);
+	}
+	if (parse & ROM_SECTION_MAP) {
+		start_job(&map_job, decode_map, &lines[line_map + 1], end_map - line_map - 1, sheet_cols, sheet_rows);
 	}
 
-	gvm_free(src);
-	return true;
+	// DATA goes first, for UPDATE to refer to. Line numbers count from 1, and
+	// the UPDATE section begins on the second.
+	bool success = true;
+	if (parse & ROM_SECTION_UPDATE) {
+		success = (line_data < 0 || parse_data(&lines[line_data + 1], n_lines - line_data - 1))
+			&& parse_update(section_start[0], section_end[0] - section_start[0], 2);
+	}
+	if (parse & ROM_SECTION_SPRITE) {
+		success = finish_job(&sprite_job, success) && success && commit_sprite(&sprite_job);
+		free_job(&sprite_job);
+	}
+	if (parse & ROM_SECTION_MAP) {
+		success = finish_job(&map_job, success) && success && commit_map(&map_job);
+		free_job(&map_job);
+	}
+
+	if (success) {
+		memcpy(section_hashes, hashes, sizeof(section_hashes));
+		have_section_hashes = true;
+		*out_parsed = parse;
+	}
+
+	current_staging = NULL;
+	gvm_free(lines);
+	close_file_view(&file);
+	return success;
+}
+
+// Makes the renderer calls of a staged reload, in the order they'd have been
+// made in, on the main thread
+// Returns: success; on failure, the next reload parses every section again
+bool commit_staging(RomStaging *staging)
+{
+	bool success = true;
+	for (int i = 0; i < staging->n_palettes; ++i) {
+		StagedPalette call = staging->palettes[i];
+		if (call.bind) {
+			bind_palette(call.target, call.palette);
+		} else {
+			set_palette_colour(call.palette, call.target, call.r, call.g, call.b);
+		}
+	}
+	if (NULL != staging->sprite_data) {
+		success = define_sprite_rows(staging->sprite_data, staging->n_rows, staging->sheet_cols, staging->sheet_rows);
+	}
+	if (success && staging->has_map) {
+		success = register_map(staging->map, staging->map_width, staging->map_height);
+	}
+
+	if (!success) {
+		have_section_hashes = false;
+	}
+	return success;
+}
+
+void free_staging(RomStaging *staging)
+{
+	gvm_free(staging->palettes);
+	gvm_free(staging->sprite_data);
+	gvm_free(staging->map);
 }
 
 static bool load_state_impl(const char *src, int src_length)
@@ -838,15 +1526,23 @@ static bool load_state_impl(const char *src, int src_length)
 
 bool load_state(const char *path)
 {
-	int src_length;
-	char *src = read_file(path, &src_length);
-	if (NULL == src) {
+	FileView file;
+	if (!read_file(path, &file)) {
 		gvm_error("Error reading file %s\n", path);
 		return false;
 	}
 
-	bool success = load_state_impl(src, src_length);
+	// Primitives and hooks for UPDATE mustn't run here
+	close_parser();
+	bool success = load_state_impl(file.chars, file.length);
 	ccm_cleanup();
-	gvm_free(src);
+	close_file_view(&file);
 	return success;
 }
+
+// Frees everything kept between parses
+void close_parser()
+{
+	ccm_cleanup();
+	predefs_timestamp = MODIFY_ERROR;
+}
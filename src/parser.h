@@ -1,7 +1,47 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include "common.h"
+
+// Sections of a ROM, in order, as bits of a mask
+#define N_ROM_SECTIONS 4
+#define ROM_SECTION_UPDATE 0x1
+#define ROM_SECTION_SPRITE 0x2
+#define ROM_SECTION_MAP 0x4
+#define ROM_SECTION_DATA 0x8 // optional
+#define ROM_ALL_SECTIONS 0xf
+
+// A palette call made while parsing UPDATE
+typedef struct {
+	bool bind;
+	uint8_t palette;
+	uint8_t target; // colour, or bind point if bind
+	float r;
+	float g;
+	float b;
+} StagedPalette;
+
+// What a reload off the main thread has for the renderer, which only the main
+// thread may use, held back for commit_staging()
+typedef struct {
+	StagedPalette *palettes;
+	int n_palettes;
+	int palette_capacity;
+	uint8_t *sprite_data; // NULL unless SPRITE was parsed
+	int n_rows;
+	int sheet_cols;
+	int sheet_rows;
+	bool has_map;
+	uint8_t (*map)[4]; // NULL if the map is empty
+	int map_width;
+	int map_height;
+} RomStaging;
+
 bool load_rom(const char *path);
+bool reload_rom(const char *path, uint8_t force, uint8_t *out_parsed, RomStaging *staging);
+bool commit_staging(RomStaging *staging);
+void free_staging(RomStaging *staging);
 bool load_state(const char *path);
+void close_parser();
 
 #endif // PARSER_H
@@ -17,7 +17,7 @@ bool begin_serialise(const char *base_path)
 
 // Returns: success
 // Failure does not obviate the need to end_serialise()
-bool serialise(const char *name, GvmConstant value)
+bool serialise(const char *name, GvmConstant value, ValueType type)
 {
 	if (open_file == NULL) {
 		return false;
@@ -27,9 +27,9 @@ bool serialise(const char *name, GvmConstant value)
 	char buf_x[32];
 	char buf_y[32];
 
-	switch (value.type) {
+	switch (type) {
 		case VAL_SCALAR:
-			sprint_scalar(buf_x, value);
+			sprint_scalar(buf_x, value.as.scalar);
 			success = fprintf(open_file, "#LOAD_SCALAR(`%s, \"%s\")\n", name, buf_x);
 			break;
 		case VAL_VEC2:
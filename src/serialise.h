@@ -4,7 +4,7 @@
 #include "value.h"
 
 bool begin_serialise(const char *base_path);
-bool serialise(const char *name, GvmConstant value);
+bool serialise(const char *name, GvmConstant value, ValueType type);
 bool end_serialise();
 
 #endif // SERIALISE_H
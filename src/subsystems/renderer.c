@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "src/filesystem.h"
 #include "src/memory.h"
 #define SUBSYSTEM_IMPL
@@ -21,8 +23,31 @@ GLfloat g_window_height = 1.0f;
 GLfloat g_pixel_scale = 1.0f;
 // TODO: Drawing map one time on register, then blitting appropriately at
 // render, saves this state and much more
-GLint g_map_width = 0;
-GLint g_map_height = 0;
+GLint g_map_tiles = 0; // drawn, so not blank
+// Copy of vbo_map, so that only instances that change are uploaded. Drawn
+// tiles are listed in map order, each with the instance it's drawn by; the
+// order of the instances themselves doesn't matter.
+typedef struct {
+	int tile;
+	int instance;
+} DrawnTile;
+static int map_width = 0;
+static int map_height = 0;
+static int map_capacity = 0; // instances, in both copies
+static GLfloat (*map_instances)[6] = NULL;
+static int *map_instance_owners = NULL; // index into map_drawn, -1 if free
+static DrawnTile *map_drawn = NULL; // g_map_tiles of them
+// Copy of TEX_SPRITESHEET, so that only rows that change are uploaded. Both
+// take the geometry of the ROM's sheet, and are remade when it changes.
+#define SPRITE_ROW_BYTES(cols) (SPRITE_SZ * SPRITE_SZ * (cols))
+static int sheet_cols = SPRITE_DEFAULT_COLS;
+static int sheet_rows = SPRITE_DEFAULT_ROWS;
+static uint8_t *sprite_sheet = NULL;
+static bool sprite_row_defined[SPRITE_MAX_ROWS];
+// Sprites with no coloured pixels draw nothing, so map tiles of them are
+// skipped. Rows never defined are uninitialised, so can't be assumed blank.
+// Indexed by column + row * SPRITE_MAX_COLS, whatever the geometry.
+static bool sprite_blank[SPRITE_MAX_COLS * SPRITE_MAX_ROWS];
 // Direction vectors (geometry scale, camera)
 #define PX_TO_DIR_X(x) (2.0f * (GLfloat)(x) / g_window_width)
 #define PX_TO_DIR_Y(y) (2.0f * (GLfloat)(-y) / g_window_height)
@@ -67,6 +92,24 @@ enum {
 };
 static GLuint programs[PROG_COUNT];
 
+// Notes which sprites of a row of the spritesheet copy are blank
+static void update_sprite_blanks(int row)
+{
+	const uint8_t *data = &sprite_sheet[row * SPRITE_ROW_BYTES(sheet_cols)];
+	for (int col = 0; col < sheet_cols; ++col) {
+		bool blank = true;
+		for (int y = 0; y < SPRITE_SZ && blank; ++y) {
+			for (int x = 0; x < SPRITE_SZ; ++x) {
+				if (data[y * SPRITE_SZ * sheet_cols + col * SPRITE_SZ + x] != 0) {
+					blank = false;
+					break;
+				}
+			}
+		}
+		sprite_blank[row * SPRITE_MAX_COLS + col] = blank;
+	}
+}
+
 // Returns: if truthy, glEnable(GL_DEBUG_OUTPUT) and related functions can be called.
 static bool have_gl_debug_output(int glad_gl_version)
 {
@@ -160,17 +203,17 @@ static void print_program_log(GLuint program)
 // Returns: shader handle, or 0 on failure
 static GLuint load_shader(char *path, GLenum shader_type)
 {
-	char *buffer = read_file_executable(path, NULL);
-	if (buffer == NULL) {
+	FileView file;
+	if (!read_file_executable(path, &file)) {
 		return 0;
 	}
 
-	// Compile shader
+	// Compile shader, which is given its length as it isn't null-terminated
 	GLuint shader = glCreateShader(shader_type);
-	glShaderSource(shader, 1, (const char * const *)&buffer, NULL);
+	glShaderSource(shader, 1, &file.chars, &file.length);
 	glCompileShader(shader);
 
-	gvm_free(buffer);
+	close_file_view(&file);
 
 	GLint compile_status;
 	glGetShaderiv(shader, GL_COMPILE_STATUS, &compile_status);
@@ -273,7 +316,7 @@ bool init_renderer(int window_width, int window_height, int pixel_scale, GLADloa
 	}
 	glBindTexture(GL_TEXTURE_2D, textures[TEX_SPRITESHEET]); {
 		// Uninitialised - using unset sprites yields undefined behaviour
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, SPRITE_COLS * SPRITE_SZ, SPRITE_ROWS * SPRITE_SZ, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, sheet_cols * SPRITE_SZ, sheet_rows * SPRITE_SZ, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	}
@@ -382,8 +425,8 @@ bool init_renderer(int window_width, int window_height, int pixel_scale, GLADloa
 			GLint scale = glGetUniformLocation(programs[PROG_SPRITE], "scale");
 			glUniform2f(scale, PX_TO_DIR_X(SPRITE_SZ), PX_TO_DIR_Y(SPRITE_SZ));
 			GLint sprite_scale = glGetUniformLocation(programs[PROG_SPRITE], "sprite_scale");
-			GLfloat scale_x = 1.0f / ((GLfloat)SPRITE_COLS);
-			GLfloat scale_y = 1.0f / ((GLfloat)SPRITE_ROWS);
+			GLfloat scale_x = 1.0f / ((GLfloat)sheet_cols);
+			GLfloat scale_y = 1.0f / ((GLfloat)sheet_rows);
 			glUniform2f(sprite_scale, scale_x, scale_y);
 		}
 	}
@@ -414,20 +457,26 @@ bool init_renderer(int window_width, int window_height, int pixel_scale, GLADloa
 			GLint scale = glGetUniformLocation(programs[PROG_MAP], "scale");
 			glUniform2f(scale, PX_TO_DIR_X(SPRITE_SZ), PX_TO_DIR_Y(SPRITE_SZ));
 			GLint sprite_scale = glGetUniformLocation(programs[PROG_MAP], "sprite_scale");
-			GLfloat scale_x = 1.0f / ((GLfloat)SPRITE_COLS);
-			GLfloat scale_y = 1.0f / ((GLfloat)SPRITE_ROWS);
+			GLfloat scale_x = 1.0f / ((GLfloat)sheet_cols);
+			GLfloat scale_y = 1.0f / ((GLfloat)sheet_rows);
 			glUniform2f(sprite_scale, scale_x, scale_y);
 			GLint sprite_location = glGetAttribLocation(programs[PROG_MAP], "sprite_location");
 			glEnableVertexAttribArray(sprite_location);
 			glVertexAttribDivisor(sprite_location, 1);
 			glBindBuffer(GL_ARRAY_BUFFER, vbo_map); {
-				glVertexAttribPointer(sprite_location, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), 0);
+				glVertexAttribPointer(sprite_location, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), 0);
 			}
 			GLint flip = glGetAttribLocation(programs[PROG_MAP], "flip");
 			glEnableVertexAttribArray(flip);
 			glVertexAttribDivisor(flip, 1);
 			glBindBuffer(GL_ARRAY_BUFFER, vbo_map); {
-				glVertexAttribPointer(flip, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), ((void *)(2 * sizeof(GLfloat))));
+				glVertexAttribPointer(flip, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), ((void *)(2 * sizeof(GLfloat))));
+			}
+			GLint tile = glGetAttribLocation(programs[PROG_MAP], "tile");
+			glEnableVertexAttribArray(tile);
+			glVertexAttribDivisor(tile, 1);
+			glBindBuffer(GL_ARRAY_BUFFER, vbo_map); {
+				glVertexAttribPointer(tile, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), ((void *)(4 * sizeof(GLfloat))));
 			}
 		}
 	}
@@ -510,50 +559,219 @@ bool set_palette_colour_impl(uint8_t palette, uint8_t colour, float r, float g,
 	return true;
 }
 
-// Overwrites given row of the spritesheet
-// Returns: success
-bool define_sprite_row_impl(const uint8_t *data, int row)
+// Remakes the spritesheet and its copy for a new geometry, with every row
+// undefined. Map instances sampling it are moved by the next register_map(),
+// which finds them all changed.
+// Returns: success; on failure, the sheet is left as it was
+static bool resize_sprite_sheet(int cols, int rows)
 {
-	if (row >= SPRITE_ROWS) {
-		gvm_error("Maximum of %d rows of sprites exceeded\n", SPRITE_ROWS);
+	GLint max_size;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	if (cols * SPRITE_SZ > max_size || rows * SPRITE_SZ > max_size) {
+		gvm_error("Sprite sheet of %dx%d sprites too big for this GPU\n", cols, rows);
+		return false;
+	}
+
+	uint8_t *sheet = gvm_malloc(rows * SPRITE_ROW_BYTES(cols));
+	if (NULL == sheet) {
 		return false;
 	}
+	gvm_free(sprite_sheet);
+	sprite_sheet = sheet;
+	sheet_cols = cols;
+	sheet_rows = rows;
+	memset(sprite_row_defined, 0, sizeof(sprite_row_defined));
+	memset(sprite_blank, 0, sizeof(sprite_blank));
 
 	glBindTexture(GL_TEXTURE_2D, textures[TEX_SPRITESHEET]); {
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, SPRITE_SZ * row, SPRITE_SZ * SPRITE_COLS, SPRITE_SZ, GL_RED_INTEGER, GL_UNSIGNED_BYTE, data);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, cols * SPRITE_SZ, rows * SPRITE_SZ, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
+	}
+	GLfloat scale_x = 1.0f / ((GLfloat)cols);
+	GLfloat scale_y = 1.0f / ((GLfloat)rows);
+	glUseProgram(programs[PROG_SPRITE]); {
+		glUniform2f(glGetUniformLocation(programs[PROG_SPRITE], "sprite_scale"), scale_x, scale_y);
+	}
+	glUseProgram(programs[PROG_MAP]); {
+		glUniform2f(glGetUniformLocation(programs[PROG_MAP], "sprite_scale"), scale_x, scale_y);
 	}
 
 	return true;
 }
 
-// Copies the given map to VRAM
+// Overwrites the first n_rows rows of a spritesheet of the given geometry.
+// Only rows that differ from what's there are uploaded, each run of them in
+// one call.
 // Returns: success
-bool register_map_impl(const uint8_t (*map)[4], int width, int height)
+bool define_sprite_rows_impl(const uint8_t *data, int n_rows, int cols, int rows)
 {
-	GLfloat *map_floats = gvm_malloc(width * height * 4 * sizeof(*map_floats));
-	if (NULL == map_floats) {
+	if (cols < 1 || cols > SPRITE_MAX_COLS || rows < 1 || rows > SPRITE_MAX_ROWS) {
+		gvm_error("Invalid sprite sheet of %dx%d sprites\n", cols, rows);
+		return false;
+	} else if (n_rows > rows) {
+		gvm_error("Maximum of %d rows of sprites exceeded\n", rows);
 		return false;
 	}
 
+	if (NULL == sprite_sheet || cols != sheet_cols || rows != sheet_rows) {
+		if (!resize_sprite_sheet(cols, rows)) {
+			return false;
+		}
+	}
+
+	glBindTexture(GL_TEXTURE_2D, textures[TEX_SPRITESHEET]);
+	int row_bytes = SPRITE_ROW_BYTES(cols);
+	int run_start = -1;
+	for (int row = 0; row <= n_rows; ++row) {
+		const uint8_t *new_row = &data[row * row_bytes];
+		uint8_t *old_row = &sprite_sheet[row * row_bytes];
+		if (row < n_rows && (!sprite_row_defined[row] || memcmp(old_row, new_row, row_bytes) != 0)) {
+			memcpy(old_row, new_row, row_bytes);
+			sprite_row_defined[row] = true;
+			update_sprite_blanks(row);
+			run_start = run_start < 0 ? row : run_start;
+		} else if (run_start >= 0) {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, SPRITE_SZ * run_start, SPRITE_SZ * cols, SPRITE_SZ * (row - run_start), GL_RED_INTEGER, GL_UNSIGNED_BYTE, &sprite_sheet[run_start * row_bytes]);
+			run_start = -1;
+		}
+	}
+
+	return true;
+}
+
+// Copies the given map to VRAM. Only tiles that draw something are copied,
+// each with its own position, so big sparse maps cost what they show. Tiles
+// are diffed against the last map, and only instances that change are
+// uploaded, each run of them in one call.
+// Returns: success
+bool register_map_impl(const uint8_t (*map)[4], int width, int height)
+{
+	if (width != map_width || height != map_height) {
+		// Nothing to diff against
+		g_map_tiles = 0;
+		map_width = width;
+		map_height = height;
+	}
+
+	int n_old = g_map_tiles;
+	int n_new = 0;
 	for (int i = 0; i < width * height; ++i) {
-		map_floats[4 * i + 0] = ((GLfloat)map[i][0]) / ((GLfloat)SPRITE_COLS);
-		map_floats[4 * i + 1] = ((GLfloat)map[i][1]) / ((GLfloat)SPRITE_ROWS);
-		map_floats[4 * i + 2] = ((GLfloat)map[i][2]);
-		map_floats[4 * i + 3] = ((GLfloat)map[i][3]);
+		if (!sprite_blank[map[i][0] + map[i][1] * SPRITE_MAX_COLS]) {
+			++n_new;
+		}
 	}
 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo_map); {
-		glBufferData(GL_ARRAY_BUFFER, width * height * 4 * sizeof(*map_floats), map_floats, GL_STATIC_DRAW);
+	bool grown = false;
+	if (n_new > map_capacity) {
+		int capacity = 2 * map_capacity > n_new ? 2 * map_capacity : n_new;
+		GLfloat (*instances)[6] = gvm_realloc(map_instances, sizeof(*map_instances) * map_capacity, sizeof(*map_instances) * capacity);
+		if (NULL == instances) {
+			return false;
+		}
+		map_instances = instances;
+		int *owners = gvm_realloc(map_instance_owners, sizeof(*map_instance_owners) * map_capacity, sizeof(*map_instance_owners) * capacity);
+		if (NULL == owners) {
+			return false;
+		}
+		map_instance_owners = owners;
+		map_capacity = capacity;
+		grown = true;
 	}
 
-	glUseProgram(programs[PROG_MAP]); {
-		glUniform1i(glGetUniformLocation(programs[PROG_MAP], "map_width"), width);
+	DrawnTile *drawn = gvm_malloc(sizeof(*drawn) * (n_new > 0 ? n_new : 1));
+	bool *dirty = gvm_malloc(sizeof(*dirty) * (n_new > 0 ? n_new : 1));
+	if (NULL == drawn || NULL == dirty) {
+		gvm_free(drawn);
+		gvm_free(dirty);
+		return false;
+	}
+	memset(dirty, grown, sizeof(*dirty) * n_new);
+
+	// Free the instances of tiles that went blank...
+	for (int i = n_old; i < n_new; ++i) {
+		map_instance_owners[i] = -1;
+	}
+	for (int i = 0; i < n_old; ++i) {
+		const uint8_t *cell = map[map_drawn[i].tile];
+		if (sprite_blank[cell[0] + cell[1] * SPRITE_MAX_COLS]) {
+			map_instance_owners[map_drawn[i].instance] = -1;
+		}
+	}
+
+	// ...and fill those below n_new from above it, so the ones drawn stay packed
+	int free_instance = 0;
+	for (int i = n_new; i < n_old; ++i) {
+		int owner = map_instance_owners[i];
+		if (owner < 0) {
+			continue;
+		}
+		while (map_instance_owners[free_instance] >= 0) {
+			++free_instance;
+		}
+		memcpy(map_instances[free_instance], map_instances[i], sizeof(*map_instances));
+		map_instance_owners[free_instance] = owner;
+		map_drawn[owner].instance = free_instance;
+		dirty[free_instance] = true;
+	}
+
+	// Tiles still drawn keep their instance, and new ones take what's free
+	int n_drawn = 0;
+	int old = 0;
+	for (int i = 0; i < width * height; ++i) {
+		if (sprite_blank[map[i][0] + map[i][1] * SPRITE_MAX_COLS]) {
+			continue;
+		}
+		GLfloat floats[6] = {
+			((GLfloat)map[i][0]) / ((GLfloat)sheet_cols),
+			((GLfloat)map[i][1]) / ((GLfloat)sheet_rows),
+			((GLfloat)map[i][2]),
+			((GLfloat)map[i][3]),
+			(GLfloat)(i % width),
+			(GLfloat)(i / width),
+		};
+
+		while (old < n_old && map_drawn[old].tile < i) {
+			++old;
+		}
+		int instance;
+		if (old < n_old && map_drawn[old].tile == i) {
+			instance = map_drawn[old].instance;
+		} else {
+			while (map_instance_owners[free_instance] >= 0) {
+				++free_instance;
+			}
+			instance = free_instance;
+			dirty[instance] = true;
+		}
+		if (dirty[instance] || memcmp(map_instances[instance], floats, sizeof(floats)) != 0) {
+			memcpy(map_instances[instance], floats, sizeof(floats));
+			dirty[instance] = true;
+		}
+		map_instance_owners[instance] = n_drawn;
+		drawn[n_drawn].tile = i;
+		drawn[n_drawn].instance = instance;
+		++n_drawn;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_map); {
+		if (grown) {
+			glBufferData(GL_ARRAY_BUFFER, sizeof(*map_instances) * map_capacity, NULL, GL_STATIC_DRAW);
+		}
+		int run_start = -1;
+		for (int i = 0; i <= n_new; ++i) {
+			if (i < n_new && dirty[i]) {
+				run_start = run_start < 0 ? i : run_start;
+			} else if (run_start >= 0) {
+				glBufferSubData(GL_ARRAY_BUFFER, sizeof(*map_instances) * run_start, sizeof(*map_instances) * (i - run_start), map_instances[run_start]);
+				run_start = -1;
+			}
+		}
 	}
 
-	g_map_width = width;
-	g_map_height = height;
+	gvm_free(map_drawn);
+	map_drawn = drawn;
+	g_map_tiles = n_new;
 
-	gvm_free(map_floats);
+	gvm_free(dirty);
 	return true;
 }
 
@@ -589,7 +807,7 @@ bool fill_rect_impl(int x, int y, int w, int h, uint8_t palette, uint8_t colour)
 
 bool sprite_impl(int x, int y, uint8_t sheet_x, uint8_t sheet_y, uint8_t palette, uint8_t h_flip, uint8_t v_flip)
 {
-	if (sheet_x >= SPRITE_COLS || sheet_y >= SPRITE_ROWS) {
+	if (sheet_x >= sheet_cols || sheet_y >= sheet_rows) {
 		gvm_error("Invalid sprite drawn: (%d, %d)\n", sheet_x, sheet_y);
 		return false;
 	} else if (palette >= N_BIND_POINTS) {
@@ -603,8 +821,8 @@ bool sprite_impl(int x, int y, uint8_t sheet_x, uint8_t sheet_y, uint8_t palette
 	glUseProgram(programs[PROG_SPRITE]); {
 		int displacement = glGetUniformLocation(programs[PROG_SPRITE], "displacement");
 		glUniform2f(displacement, PX_TO_POS_X(x), PX_TO_POS_Y(y));
-		GLfloat sheet_x_rel = ((GLfloat)sheet_x) / ((GLfloat)SPRITE_COLS);
-		GLfloat sheet_y_rel = ((GLfloat)sheet_y) / ((GLfloat)SPRITE_ROWS);
+		GLfloat sheet_x_rel = ((GLfloat)sheet_x) / ((GLfloat)sheet_cols);
+		GLfloat sheet_y_rel = ((GLfloat)sheet_y) / ((GLfloat)sheet_rows);
 		int sprite_location = glGetUniformLocation(programs[PROG_SPRITE], "sprite_location");
 		glUniform2f(sprite_location, sheet_x_rel, sheet_y_rel);
 		glUniform1ui(glGetUniformLocation(programs[PROG_SPRITE], "palette"), palette);
@@ -631,7 +849,7 @@ void render()
 	glViewport(0, 0, g_window_width, g_window_height);
 	glClearColor(0.0, 0.0, 0.0, 0.0); {
 		glClear(GL_COLOR_BUFFER_BIT);
-		glDrawArraysInstanced(GL_TRIANGLES, 0, 6, g_map_width * g_map_height);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, 6, g_map_tiles);
 	}
 
 	// Resolve colours of intermediate buffers
@@ -667,6 +885,10 @@ void close_renderer()
 		glDeleteBuffers(1, &vbo_quad);
 		glDeleteBuffers(1, &vbo_map);
 	}
+	gvm_free(map_instances);
+	gvm_free(map_instance_owners);
+	gvm_free(map_drawn);
+	gvm_free(sprite_sheet);
 
 	glDeleteTextures(TEX_COUNT, textures);
 	glDeleteFramebuffers(1, &fb_uncoloured_buffer);
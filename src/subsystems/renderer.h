@@ -12,7 +12,7 @@ bool init_renderer(int window_width, int window_height, int pixel_scale, GLADloa
 bool bind_palette_impl(uint8_t bind_point, uint8_t target);
 void set_camera_impl(int x, int y);
 bool set_palette_colour_impl(uint8_t palette, uint8_t colour, float r, float g, float b);
-bool define_sprite_row_impl(const uint8_t *data, int row);
+bool define_sprite_rows_impl(const uint8_t *data, int n_rows, int cols, int rows);
 bool register_map_impl(const uint8_t (*map)[4], int width, int height);
 bool fill_rect_impl(int x, int y, int w, int h, uint8_t palette, uint8_t color);
 bool sprite_impl(int x, int y, uint8_t sheet_x, uint8_t sheet_y, uint8_t palette, uint8_t h_flip, uint8_t v_flip);
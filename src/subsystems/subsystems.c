@@ -91,9 +91,9 @@ bool set_palette_colour(uint8_t palette, uint8_t colour, float r, float g, float
 }
 
 // Returns: success
-bool define_sprite_row(const uint8_t *data, int row)
+bool define_sprite_rows(const uint8_t *data, int n_rows, int sheet_cols, int sheet_rows)
 {
-	return define_sprite_row_impl(data, row);
+	return define_sprite_rows_impl(data, n_rows, sheet_cols, sheet_rows);
 }
 
 // Returns: success
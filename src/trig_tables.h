@@ -0,0 +1,127 @@
+#ifndef TRIG_TABLES_H
+#define TRIG_TABLES_H
+
+#include <stdint.h>
+
+// Frozen so that trig gives the same bits on every platform, whatever its libm.
+// Generated with Python:
+//   [round(math.sin(k * math.pi / 2 / 1024) * 1e6) for k in range(1025)]
+//   [round(math.atan(k / 256) / (2 * math.pi) * 1e6) for k in range(257)]
+
+// sin() over a quarter turn in 1024 steps, as raw FixedPoint
+static const int32_t SIN_TABLE[1025] = {
+	0, 1534, 3068, 4602, 6136, 7670, 9204, 10738, 12272, 13805, 15339, 16873,
+	18407, 19940, 21474, 23008, 24541, 26075, 27608, 29142, 30675, 32208, 33741, 35274,
+	36807, 38340, 39873, 41406, 42938, 44471, 46003, 47535, 49068, 50600, 52132, 53664,
+	55195, 56727, 58258, 59790, 61321, 62852, 64383, 65913, 67444, 68974, 70505, 72035,
+	73565, 75094, 76624, 78153, 79682, 81211, 82740, 84269, 85797, 87326, 88854, 90381,
+	91909, 93436, 94963, 96490, 98017, 99544, 101070, 102596, 104122, 105647, 107172, 108697,
+	110222, 111747, 113271, 114795, 116319, 117842, 119365, 120888, 122411, 123933, 125455, 126977,
+	128498, 130019, 131540, 133061, 134581, 136101, 137620, 139139, 140658, 142177, 143695, 145213,
+	146730, 148248, 149765, 151281, 152797, 154313, 155828, 157343, 158858, 160372, 161886, 163400,
+	164913, 166426, 167938, 169450, 170962, 172473, 173984, 175494, 177004, 178514, 180023, 181532,
+	183040, 184548, 186055, 187562, 189069, 190575, 192080, 193586, 195090, 196595, 198098, 199602,
+	201105, 202607, 204109, 205610, 207111, 208612, 210112, 211611, 213110, 214609, 216107, 217604,
+	219101, 220598, 222094, 223589, 225084, 226578, 228072, 229565, 231058, 232550, 234042, 235533,
+	237024, 238514, 240003, 241492, 242980, 244468, 245955, 247442, 248928, 250413, 251898, 253382,
+	254866, 256349, 257831, 259313, 260794, 262275, 263755, 265234, 266713, 268191, 269668, 271145,
+	272621, 274097, 275572, 277046, 278520, 279993, 281465, 282937, 284408, 285878, 287347, 288816,
+	290285, 291752, 293219, 294685, 296151, 297616, 299080, 300543, 302006, 303468, 304929, 306390,
+	307850, 309309, 310767, 312225, 313682, 315138, 316593, 318048, 319502, 320955, 322408, 323859,
+	325310, 326760, 328210, 329658, 331106, 332553, 334000, 335445, 336890, 338334, 339777, 341219,
+	342661, 344101, 345541, 346980, 348419, 349856, 351293, 352729, 354164, 355598, 357031, 358463,
+	359895, 361326, 362756, 364185, 365613, 367040, 368467, 369892, 371317, 372741, 374164, 375586,
+	377007, 378428, 379847, 381266, 382683, 384100, 385516, 386931, 388345, 389758, 391170, 392582,
+	393992, 395401, 396810, 398218, 399624, 401030, 402435, 403838, 405241, 406643, 408044, 409444,
+	410843, 412241, 413638, 415034, 416430, 417824, 419217, 420609, 422000, 423390, 424780, 426168,
+	427555, 428941, 430326, 431711, 433094, 434476, 435857, 437237, 438616, 439994, 441371, 442747,
+	444122, 445496, 446869, 448241, 449611, 450981, 452350, 453717, 455084, 456449, 457813, 459177,
+	460539, 461900, 463260, 464619, 465976, 467333, 468689, 470043, 471397, 472749, 474100, 475450,
+	476799, 478147, 479494, 480839, 482184, 483527, 484869, 486210, 487550, 488889, 490226, 491563,
+	492898, 494232, 495565, 496897, 498228, 499557, 500885, 502212, 503538, 504863, 506187, 507509,
+	508830, 510150, 511469, 512786, 514103, 515418, 516732, 518045, 519356, 520666, 521975, 523283,
+	524590, 525895, 527199, 528502, 529804, 531104, 532403, 533701, 534998, 536293, 537587, 538880,
+	540171, 541462, 542751, 544039, 545325, 546610, 547894, 549177, 550458, 551738, 553017, 554294,
+	555570, 556845, 558119, 559391, 560662, 561931, 563199, 564466, 565732, 566996, 568259, 569521,
+	570781, 572040, 573297, 574553, 575808, 577062, 578314, 579565, 580814, 582062, 583309, 584554,
+	585798, 587040, 588282, 589521, 590760, 591997, 593232, 594466, 595699, 596931, 598161, 599389,
+	600616, 601842, 603067, 604290, 605511, 606731, 607950, 609167, 610383, 611597, 612810, 614022,
+	615232, 616440, 617647, 618853, 620057, 621260, 622461, 623661, 624859, 626056, 627252, 628446,
+	629638, 630829, 632019, 633207, 634393, 635578, 636762, 637944, 639124, 640303, 641481, 642657,
+	643832, 645005, 646176, 647346, 648514, 649681, 650847, 652011, 653173, 654334, 655493, 656651,
+	657807, 658961, 660114, 661266, 662416, 663564, 664711, 665856, 667000, 668142, 669283, 670422,
+	671559, 672695, 673829, 674962, 676093, 677222, 678350, 679476, 680601, 681724, 682846, 683965,
+	685084, 686200, 687315, 688429, 689541, 690651, 691759, 692866, 693971, 695075, 696177, 697278,
+	698376, 699473, 700569, 701663, 702755, 703845, 704934, 706021, 707107, 708191, 709273, 710353,
+	711432, 712509, 713585, 714659, 715731, 716801, 717870, 718937, 720003, 721066, 722128, 723188,
+	724247, 725304, 726359, 727413, 728464, 729514, 730563, 731609, 732654, 733697, 734739, 735779,
+	736817, 737853, 738887, 739920, 740951, 741980, 743008, 744034, 745058, 746080, 747101, 748119,
+	749136, 750152, 751165, 752177, 753187, 754195, 755201, 756206, 757209, 758210, 759209, 760207,
+	761202, 762196, 763188, 764179, 765167, 766154, 767139, 768122, 769103, 770083, 771061, 772036,
+	773010, 773983, 774953, 775922, 776888, 777853, 778817, 779778, 780737, 781695, 782651, 783605,
+	784557, 785507, 786455, 787402, 788346, 789289, 790230, 791169, 792107, 793042, 793975, 794907,
+	795837, 796765, 797691, 798615, 799537, 800458, 801376, 802293, 803208, 804120, 805031, 805940,
+	806848, 807753, 808656, 809558, 810457, 811355, 812251, 813144, 814036, 814926, 815814, 816701,
+	817585, 818467, 819348, 820226, 821103, 821977, 822850, 823721, 824589, 825456, 826321, 827184,
+	828045, 828904, 829761, 830616, 831470, 832321, 833170, 834018, 834863, 835706, 836548, 837387,
+	838225, 839060, 839894, 840725, 841555, 842383, 843208, 844032, 844854, 845673, 846491, 847307,
+	848120, 848932, 849742, 850549, 851355, 852159, 852961, 853760, 854558, 855354, 856147, 856939,
+	857729, 858516, 859302, 860085, 860867, 861646, 862424, 863199, 863973, 864744, 865514, 866281,
+	867046, 867809, 868571, 869330, 870087, 870842, 871595, 872346, 873095, 873842, 874587, 875329,
+	876070, 876809, 877545, 878280, 879012, 879743, 880471, 881197, 881921, 882643, 883363, 884081,
+	884797, 885511, 886223, 886932, 887640, 888345, 889048, 889750, 890449, 891146, 891841, 892534,
+	893224, 893913, 894599, 895284, 895966, 896646, 897325, 898001, 898674, 899346, 900016, 900683,
+	901349, 902012, 902673, 903332, 903989, 904644, 905297, 905947, 906596, 907242, 907886, 908528,
+	909168, 909806, 910441, 911075, 911706, 912335, 912962, 913587, 914210, 914830, 915449, 916065,
+	916679, 917291, 917901, 918508, 919114, 919717, 920318, 920917, 921514, 922109, 922701, 923291,
+	923880, 924465, 925049, 925631, 926210, 926787, 927363, 927935, 928506, 929075, 929641, 930205,
+	930767, 931327, 931884, 932440, 932993, 933544, 934093, 934639, 935184, 935726, 936266, 936803,
+	937339, 937872, 938404, 938932, 939459, 939984, 940506, 941026, 941544, 942060, 942573, 943084,
+	943593, 944100, 944605, 945107, 945607, 946105, 946601, 947094, 947586, 948075, 948561, 949046,
+	949528, 950008, 950486, 950962, 951435, 951906, 952375, 952842, 953306, 953768, 954228, 954686,
+	955141, 955594, 956045, 956494, 956940, 957385, 957826, 958266, 958703, 959139, 959572, 960002,
+	960431, 960857, 961280, 961702, 962121, 962538, 962953, 963366, 963776, 964184, 964590, 964993,
+	965394, 965793, 966190, 966584, 966976, 967366, 967754, 968139, 968522, 968903, 969281, 969657,
+	970031, 970403, 970772, 971139, 971504, 971866, 972226, 972584, 972940, 973293, 973644, 973993,
+	974339, 974684, 975025, 975365, 975702, 976037, 976370, 976700, 977028, 977354, 977677, 977999,
+	978317, 978634, 978948, 979260, 979570, 979877, 980182, 980485, 980785, 981083, 981379, 981673,
+	981964, 982253, 982539, 982824, 983105, 983385, 983662, 983937, 984210, 984480, 984749, 985014,
+	985278, 985539, 985798, 986054, 986308, 986560, 986809, 987057, 987301, 987544, 987784, 988022,
+	988258, 988491, 988722, 988950, 989177, 989400, 989622, 989841, 990058, 990273, 990485, 990695,
+	990903, 991108, 991311, 991511, 991710, 991906, 992099, 992291, 992480, 992666, 992850, 993032,
+	993212, 993389, 993564, 993737, 993907, 994075, 994240, 994404, 994565, 994723, 994879, 995033,
+	995185, 995334, 995481, 995625, 995767, 995907, 996045, 996180, 996313, 996443, 996571, 996697,
+	996820, 996941, 997060, 997176, 997290, 997402, 997511, 997618, 997723, 997825, 997925, 998023,
+	998118, 998211, 998302, 998390, 998476, 998559, 998640, 998719, 998795, 998870, 998941, 999011,
+	999078, 999142, 999205, 999265, 999322, 999378, 999431, 999481, 999529, 999575, 999619, 999660,
+	999699, 999735, 999769, 999801, 999831, 999858, 999882, 999905, 999925, 999942, 999958, 999971,
+	999981, 999989, 999995, 999999, 1000000,
+};
+
+// atan(k / 256) for k in [0, 256], in raw FixedPoint turns
+static const int32_t ATAN_TABLE[257] = {
+	0, 622, 1243, 1865, 2487, 3108, 3730, 4351, 4972, 5593, 6214, 6834,
+	7455, 8075, 8695, 9315, 9934, 10553, 11172, 11791, 12409, 13027, 13644, 14261,
+	14877, 15493, 16109, 16724, 17339, 17953, 18566, 19179, 19792, 20404, 21015, 21625,
+	22235, 22845, 23453, 24061, 24668, 25275, 25881, 26486, 27090, 27694, 28296, 28898,
+	29499, 30099, 30698, 31297, 31894, 32491, 33087, 33681, 34275, 34868, 35460, 36051,
+	36641, 37229, 37817, 38404, 38990, 39574, 40158, 40740, 41321, 41901, 42481, 43058,
+	43635, 44211, 44785, 45358, 45930, 46501, 47070, 47639, 48206, 48771, 49336, 49899,
+	50461, 51022, 51581, 52139, 52696, 53251, 53805, 54358, 54909, 55459, 56007, 56554,
+	57100, 57644, 58187, 58729, 59269, 59808, 60345, 60881, 61415, 61948, 62479, 63009,
+	63538, 64065, 64591, 65115, 65637, 66158, 66678, 67196, 67712, 68227, 68741, 69253,
+	69763, 70272, 70780, 71286, 71790, 72293, 72794, 73294, 73792, 74288, 74783, 75277,
+	75769, 76259, 76748, 77235, 77721, 78205, 78687, 79168, 79648, 80125, 80602, 81076,
+	81549, 82021, 82491, 82959, 83426, 83891, 84355, 84817, 85277, 85736, 86193, 86649,
+	87103, 87556, 88007, 88456, 88904, 89350, 89795, 90238, 90680, 91120, 91558, 91995,
+	92430, 92864, 93296, 93727, 94156, 94584, 95010, 95434, 95857, 96278, 96698, 97117,
+	97533, 97949, 98362, 98775, 99185, 99594, 100002, 100408, 100813, 101216, 101618, 102018,
+	102416, 102814, 103209, 103603, 103996, 104387, 104777, 105165, 105552, 105937, 106321, 106704,
+	107085, 107464, 107842, 108219, 108594, 108968, 109340, 109711, 110081, 110449, 110815, 111181,
+	111544, 111907, 112268, 112628, 112986, 113343, 113698, 114053, 114405, 114757, 115107, 115456,
+	115803, 116149, 116494, 116837, 117179, 117520, 117859, 118197, 118534, 118869, 119203, 119536,
+	119868, 120198, 120527, 120855, 121181, 121506, 121830, 122153, 122474, 122794, 123113, 123430,
+	123747, 124062, 124376, 124689, 125000,
+};
+
+#endif // TRIG_TABLES_H
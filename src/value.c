@@ -2,18 +2,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "trig_tables.h"
 #include "value.h"
 
-// Fixed-point in range [-10e8 + 1, 10e8 - 1] with resolution of 10e-6
-// This requires 47 bits (plus the sign bit).
-// Int addition/subtraction will never overflow, as the absolute magnitude can
-// only reach 48 bits before we clamp back down.
-// Double multiplication/division is lossless, as doubles have 52 bits of
-// precision at all magnitudes.
-#define FP_DEN 1000000l               // denominator of epsilon
-#define FP_EPS (1.0 / (double)FP_DEN) // resolution and epsilon
-#define FP_MAX (99999999l * FP_DEN)   // greatest magnitude
-#define FX2FL(fx) ((fx) * FP_EPS)     // fixed-point to double
+#define FP_TURN FP_DEN                // angles are in turns: 1.0 is a full circle
 
 #define SCX(constant) ((constant).as.scalar)
 #define V2X(constant) ((constant).as.vec2[0])
@@ -22,7 +14,6 @@
 static GvmConstant scalar(FixedPoint x)
 {
 	GvmConstant c;
-	c.type = VAL_SCALAR;
 	c.as.scalar = x;
 	return c;
 }
@@ -30,236 +21,158 @@ static GvmConstant scalar(FixedPoint x)
 static GvmConstant vec2(FixedPoint x, FixedPoint y)
 {
 	GvmConstant c;
-	c.type = VAL_VEC2;
 	c.as.vec2[0] = x;
 	c.as.vec2[1] = y;
 	return c;
 }
 
-static FixedPoint double_to_fixed(double d)
-{
-	// TODO: Round, don't floor
-	return d * FP_DEN;
-}
-
-static FixedPoint int_to_fixed(int x)
-{
-	return x * FP_DEN;
-}
-
-static FixedPoint fixed_add(FixedPoint a, FixedPoint b)
+// Behaviour undefined when a < 0
+// TODO: May be desirable to avoid sqrt() and math.h
+static FixedPoint fixed_sqrt(FixedPoint a)
 {
-	FixedPoint res = a + b;
-	if (res > FP_MAX) {
-		return FP_MAX;
-	} else if (res < -FP_MAX) {
-		return -FP_MAX;
+	double a_d = FX2FL(a);
+	if (a_d < 0) {
+		return double_to_fixed(-sqrt(-a_d));
 	} else {
-		return res;
+		return double_to_fixed(sqrt(a_d));
 	}
 }
 
-static FixedPoint fixed_subtract(FixedPoint a, FixedPoint b)
+FixedPoint add_scalars(FixedPoint a, FixedPoint b)
 {
-	return fixed_add(a, -b);
+	return fixed_add(a, b);
 }
 
-// TODO: Avoid visiting float land
-static FixedPoint fixed_multiply(FixedPoint a, FixedPoint b)
+GvmConstant add_vec2s(GvmConstant a, GvmConstant b)
 {
-	double a_d = FX2FL(a);
-	double b_d = FX2FL(b);
-	double res = a_d * b_d;
-	return double_to_fixed(res);
+	return vec2(fixed_add(V2X(a), V2X(b)), fixed_add(V2Y(a), V2Y(b)));
 }
 
-// Behaviour undefined when b == 0 - try to catch that case before calling this
-static FixedPoint fixed_divide(FixedPoint a, FixedPoint b)
+FixedPoint subtract_scalars(FixedPoint a, FixedPoint b)
 {
-	if (b == 0) {
-		if (a > 0) {
-			return FP_MAX;
-		} else if (a < 0) {
-			return -FP_MAX;
-		} else {
-			return 0;
-		}
-	}
-
-	double a_d = FX2FL(a);
-	double b_d = FX2FL(b);
-	double res = a_d / b_d;
-	return double_to_fixed(res);
+	return fixed_subtract(a, b);
 }
 
-// Behaviour undefined when a < 0
-// TODO: May be desirable to avoid sqrt() and math.h
-static FixedPoint fixed_sqrt(FixedPoint a)
+GvmConstant subtract_vec2s(GvmConstant a, GvmConstant b)
 {
-	double a_d = FX2FL(a);
-	if (a_d < 0) {
-		return double_to_fixed(-sqrt(-a_d));
-	} else {
-		return double_to_fixed(sqrt(a_d));
-	}
+	return vec2(fixed_subtract(V2X(a), V2X(b)), fixed_subtract(V2Y(a), V2Y(b)));
 }
 
-// Adds two values, respecting the type of the first operand
-// It is up to the caller to ensure matching operands (or not to care)
-GvmConstant add_vals(GvmConstant a, GvmConstant b)
+FixedPoint multiply_scalars(FixedPoint a, FixedPoint b)
 {
-	switch (a.type) {
-		case VAL_SCALAR:
-			return scalar(fixed_add(SCX(a), SCX(b)));
-		case VAL_VEC2:
-			return vec2(fixed_add(V2X(a), V2X(b)), fixed_add(V2Y(a), V2Y(b)));
-	}
-
-	return scalar(0); // Unreachable
+	return fixed_multiply(a, b);
 }
 
-// Subtracts two values, respecting the type of the first operand
-GvmConstant subtract_vals(GvmConstant a, GvmConstant b)
+// Element-wise multiplication
+GvmConstant multiply_vec2s(GvmConstant a, GvmConstant b)
 {
-	switch (a.type) {
-		case VAL_SCALAR:
-			return scalar(fixed_subtract(SCX(a), SCX(b)));
-		case VAL_VEC2:
-			return vec2(fixed_subtract(V2X(a), V2X(b)), fixed_subtract(V2Y(a), V2Y(b)));
-	}
-
-	return scalar(0); // Unreachable
+	return vec2(fixed_multiply(V2X(a), V2X(b)), fixed_multiply(V2Y(a), V2Y(b)));
 }
 
-// Multiplies two values - for vec2, element-wise multiplication
-GvmConstant multiply_vals(GvmConstant a, GvmConstant b)
+FixedPoint divide_scalars(FixedPoint a, FixedPoint b)
 {
-	switch (a.type) {
-		case VAL_SCALAR:
-			return scalar(fixed_multiply(SCX(a), SCX(b)));
-		case VAL_VEC2:
-			return vec2(fixed_multiply(V2X(a), V2X(b)), fixed_multiply(V2Y(a), V2Y(b)));
-	}
-
-	return scalar(0); // Unreachable
+	return fixed_divide(a, b);
 }
 
-// Divides two values - for vec2, element-wise
-GvmConstant divide_vals(GvmConstant a, GvmConstant b)
+// Element-wise division
+GvmConstant divide_vec2s(GvmConstant a, GvmConstant b)
 {
-	switch (a.type) {
-		case VAL_SCALAR:
-			return scalar(fixed_divide(SCX(a), SCX(b)));
-		case VAL_VEC2:
-			return vec2(fixed_divide(V2X(a), V2X(b)), fixed_divide(V2Y(a), V2Y(b)));
-	}
-
-	return scalar(0); // Unreachable
+	return vec2(fixed_divide(V2X(a), V2X(b)), fixed_divide(V2Y(a), V2Y(b)));
 }
 
-static FixedPoint call_rng(GvmConstant *seed)
+static uint64_t call_rng(FixedPoint *seed)
 {
-	FixedPoint seed_fp = SCX(*seed);
-	long roll = gvm_rand(seed_fp);
-	*seed = scalar(roll);
+	uint64_t state = *seed;
+	uint64_t roll = gvm_rand(&state);
+	*seed = state;
 	return roll;
 }
 
 // Returns: random scalar in [0, 1), using seed
-// Sets seed to the raw RNG roll
-GvmConstant rand_val(GvmConstant *seed)
+// Advances seed
+FixedPoint rand_val(FixedPoint *seed)
 {
-	FixedPoint roll = call_rng(seed);
-	return scalar(roll % FP_DEN);
+	uint64_t roll = call_rng(seed);
+	return roll % FP_DEN;
 }
 
 // Returns: random int in [0, max), using seed
-// Sets seed to the raw RNG roll
-GvmConstant rand_int_val(GvmConstant max, GvmConstant *seed)
+// Advances seed
+FixedPoint rand_int_val(FixedPoint max, FixedPoint *seed)
 {
-	FixedPoint roll = call_rng(seed);
-	FixedPoint max_int = SCX(max) / FP_DEN;
+	uint64_t roll = call_rng(seed);
+	FixedPoint max_int = max / FP_DEN;
 	if (max_int <= 1) {
-		return scalar(0);
+		return 0;
 	} else {
-		return scalar(roll % max_int * FP_DEN);
+		return roll % max_int * FP_DEN;
 	}
 }
 
-static FixedPoint floor_raw(FixedPoint from, FixedPoint snap)
-{
-	// TODO: Careful, we're cheating here by treating FixedPoints directly
-	FixedPoint ret = snap * (from / snap);
-	if (from < 0) {
-		ret -= snap;
-	}
-	return ret;
-}
-
 // Arguments: scalar 'from', scalar integer 'snap'
 // Returns: nearest exact multiple of snap below from, inclusive
-GvmConstant floor_val(GvmConstant from, GvmConstant snap)
+FixedPoint floor_val(FixedPoint from, FixedPoint snap)
 {
-	return scalar(floor_raw(SCX(from), SCX(snap)));
+	return floor_raw(from, snap);
 }
 
-GvmConstant ceil_val(GvmConstant from, GvmConstant snap)
+FixedPoint ceil_val(FixedPoint from, FixedPoint snap)
 {
-	return scalar(floor_raw(SCX(from) + SCX(snap) - 1, SCX(snap)));
+	return floor_raw(from + snap - 1, snap);
 }
 
 // Exclusive-range versions of floor and ceil
 // e.g. ceil_val(47, 12) == 48, ceil_val_ex(47, 12) == 48,
 //      ceil_val(48, 12) == 48, ceil_val_ex(48, 12) == 60
-GvmConstant floor_val_ex(GvmConstant from, GvmConstant snap)
+FixedPoint floor_val_ex(FixedPoint from, FixedPoint snap)
 {
-	return scalar(floor_raw(SCX(from) - 1, SCX(snap)));
+	return floor_raw(from - 1, snap);
 }
 
-GvmConstant ceil_val_ex(GvmConstant from, GvmConstant snap)
+FixedPoint ceil_val_ex(FixedPoint from, FixedPoint snap)
 {
-	return scalar(floor_raw(SCX(from) + SCX(snap), SCX(snap)));
+	return floor_raw(from + snap, snap);
 }
 
-// Compares two values, treating them as scalars
-// To use as GvmConstant, call int_to_scalar()
-bool val_less_than(GvmConstant a, GvmConstant b)
+// Compares two scalars
+// To use as a scalar, call int_to_scalar()
+bool val_less_than(FixedPoint a, FixedPoint b)
 {
-	return SCX(a) < SCX(b);
+	return a < b;
 }
 
-bool val_greater_than(GvmConstant a, GvmConstant b)
+bool val_greater_than(FixedPoint a, FixedPoint b)
 {
-	return SCX(a) > SCX(b);
+	return a > b;
 }
 
-bool val_equal(GvmConstant a, GvmConstant b)
+bool val_equal(FixedPoint a, FixedPoint b)
 {
-	return SCX(a) == SCX(b);
+	return a == b;
 }
 
-// Treating a and b as scalars, takes their modulus
+// Takes the modulus of scalars a and b
 // If either is non-integer, return value is unspecified
-GvmConstant val_modulus(GvmConstant a, GvmConstant b)
+FixedPoint val_modulus(FixedPoint a, FixedPoint b)
 {
-	int a_whole = SCX(a) / FP_DEN;
-	int b_whole = SCX(b) / FP_DEN;
-	return scalar(a_whole % b_whole * FP_DEN);
+	int a_whole = a / FP_DEN;
+	int b_whole = b / FP_DEN;
+	return a_whole % b_whole * FP_DEN;
 }
 
-GvmConstant val_vec2_get_x(GvmConstant v)
+FixedPoint val_vec2_get_x(GvmConstant v)
 {
-	return scalar(V2X(v));
+	return V2X(v);
 }
 
-GvmConstant val_vec2_get_y(GvmConstant v)
+FixedPoint val_vec2_get_y(GvmConstant v)
 {
-	return scalar(V2Y(v));
+	return V2Y(v);
 }
 
-GvmConstant val_vec2_make(GvmConstant x, GvmConstant y)
+GvmConstant val_vec2_make(FixedPoint x, FixedPoint y)
 {
-	return vec2(SCX(x), SCX(y));
+	return vec2(x, y);
 }
 
 GvmConstant val_vec2_normalize(GvmConstant v)
@@ -274,27 +187,168 @@ GvmConstant val_vec2_normalize(GvmConstant v)
 	return vec2(x, y);
 }
 
+// Returns: a * b, rounded toward zero like fixed_multiply(), for |b| <= 1.0
+// Integer-only, so trig results don't depend on the platform's FPU.
+static FixedPoint fixed_multiply_unit(FixedPoint a, FixedPoint b)
+{
+	FixedPoint high = a / FP_DEN;
+	FixedPoint low = a % FP_DEN;
+	return high * b + low * b / FP_DEN;
+}
+
+// Returns: sin(angle), angle in turns
+// Linear interpolation on SIN_TABLE, mirrored into the other quadrants.
+static FixedPoint fixed_sin(FixedPoint angle)
+{
+	const FixedPoint quarter = 1024 * FP_DEN;
+	FixedPoint phase = angle % FP_TURN;
+	if (phase < 0) {
+		phase += FP_TURN;
+	}
+
+	// Position in table steps, with FP_DEN steps of interpolation between them
+	FixedPoint pos = phase * 4096;
+	int quadrant = pos / quarter;
+	pos %= quarter;
+	if (quadrant & 1) {
+		pos = quarter - pos;
+	}
+
+	FixedPoint index = pos / FP_DEN;
+	FixedPoint frac = pos % FP_DEN;
+	FixedPoint res = SIN_TABLE[index];
+	if (frac != 0) {
+		res += ((FixedPoint)(SIN_TABLE[index + 1] - SIN_TABLE[index]) * frac + FP_DEN / 2) / FP_DEN;
+	}
+
+	return quadrant >= 2 ? -res : res;
+}
+
+// Returns: angle of (x, y) in turns, in (-0.5, 0.5], or 0 for (0, 0)
+static FixedPoint fixed_atan2(FixedPoint y, FixedPoint x)
+{
+	uint64_t ax = x < 0 ? -x : x;
+	uint64_t ay = y < 0 ? -y : y;
+	if (ax == 0 && ay == 0) {
+		return 0;
+	}
+
+	// Fold into the first octant, so the ratio's in [0, 1]
+	bool steep = ay > ax;
+	uint64_t num = steep ? ax : ay;
+	uint64_t den = steep ? ay : ax;
+	// Make room to shift num up by 32; costs nothing past 31 bits of precision
+	while (den >= UINT64_C(1) << 31) {
+		num >>= 1;
+		den >>= 1;
+	}
+
+	// Ratio as 8.24 table steps
+	uint64_t pos = (num << 32) / den;
+	uint64_t index = pos >> 24;
+	uint64_t frac = pos & 0xFFFFFF;
+	FixedPoint res = ATAN_TABLE[index];
+	if (frac != 0) {
+		res += ((FixedPoint)(ATAN_TABLE[index + 1] - ATAN_TABLE[index]) * (FixedPoint)frac + (1 << 23)) >> 24;
+	}
+
+	if (steep) {
+		res = FP_TURN / 4 - res;
+	}
+	if (x < 0) {
+		res = FP_TURN / 2 - res;
+	}
+	return y < 0 ? -res : res;
+}
+
+// Returns: floor(sqrt(n)), for n < 2^63
+// The float estimate is only a starting point: the integer fix-up makes the
+// result exact, so it doesn't matter how the platform rounds.
+static uint64_t isqrt(uint64_t n)
+{
+	uint64_t res = sqrt((double)n);
+	while (res * res > n) {
+		--res;
+	}
+	while ((res + 1) * (res + 1) <= n) {
+		++res;
+	}
+	return res;
+}
+
+// Returns: |(x, y)|, rounded down and saturating
+static FixedPoint fixed_length(FixedPoint x, FixedPoint y)
+{
+	uint64_t ax = x < 0 ? -x : x;
+	uint64_t ay = y < 0 ? -y : y;
+	// Squares must fit in 64 bits. Length scales linearly, so scale down and
+	// back up - this only loses precision past 31 significant bits.
+	int shift = 0;
+	for (uint64_t m = (ax | ay) >> 31; m != 0; m >>= 1) {
+		++shift;
+	}
+	ax >>= shift;
+	ay >>= shift;
+
+	uint64_t res = isqrt(ax * ax + ay * ay) << shift;
+	return res > FP_MAX ? FP_MAX : res;
+}
+
+// Trig works in turns rather than radians, so whole fractions of a circle are
+// exact. Everything here is integer arithmetic on frozen tables: the results
+// are bit-identical across platforms, unlike libm.
+FixedPoint val_sin(FixedPoint angle)
+{
+	return fixed_sin(angle);
+}
+
+FixedPoint val_cos(FixedPoint angle)
+{
+	return fixed_sin(angle + FP_TURN / 4);
+}
+
+// Like atan2(y, x)
+FixedPoint val_vec2_angle(GvmConstant v)
+{
+	return fixed_atan2(V2Y(v), V2X(v));
+}
+
+FixedPoint val_vec2_length(GvmConstant v)
+{
+	return fixed_length(V2X(v), V2Y(v));
+}
+
+// Rotates anticlockwise in a y-up frame (clockwise on screen, where y is down)
+GvmConstant val_vec2_rotate(GvmConstant v, FixedPoint angle)
+{
+	FixedPoint c = val_cos(angle);
+	FixedPoint s = val_sin(angle);
+	FixedPoint x = fixed_subtract(fixed_multiply_unit(V2X(v), c), fixed_multiply_unit(V2Y(v), s));
+	FixedPoint y = fixed_add(fixed_multiply_unit(V2X(v), s), fixed_multiply_unit(V2Y(v), c));
+	return vec2(x, y);
+}
+
 // Like ! operator - converts scalar b to scalar 0 or 1
-GvmConstant val_falsify(GvmConstant b)
+FixedPoint val_falsify(FixedPoint b)
 {
-	return scalar(!SCX(b));
+	return !b;
 }
 
-GvmConstant val_and(GvmConstant a, GvmConstant b)
+FixedPoint val_and(FixedPoint a, FixedPoint b)
 {
-	if (SCX(a) != 0 && SCX(b) != 0) {
-		return scalar(1);
+	if (a != 0 && b != 0) {
+		return 1;
 	} else {
-		return scalar(0);
+		return 0;
 	}
 }
 
-GvmConstant val_or(GvmConstant a, GvmConstant b)
+FixedPoint val_or(FixedPoint a, FixedPoint b)
 {
-	if (SCX(a) != 0 || SCX(b) != 0) {
-		return scalar(1);
+	if (a != 0 || b != 0) {
+		return 1;
 	} else {
-		return scalar(0);
+		return 0;
 	}
 }
 
@@ -313,9 +367,9 @@ static void sprint_fixed(char *buffer, FixedPoint n)
 
 // Fearlessly places human-readable serialisation in buffer
 // Buffer must be at least 32 bytes long
-void sprint_scalar(char *buffer, GvmConstant value)
+void sprint_scalar(char *buffer, FixedPoint value)
 {
-	sprint_fixed(buffer, SCX(value));
+	sprint_fixed(buffer, value);
 }
 
 void sprint_vec2_x(char *buffer, GvmConstant value)
@@ -329,14 +383,14 @@ void sprint_vec2_y(char *buffer, GvmConstant value)
 }
 
 // TODO: Should this live in debug?
-void print_value(GvmConstant val)
+void print_value(GvmConstant val, ValueType type)
 {
 	char buf_x[32];
 	char buf_y[32];
 
-	switch (val.type) {
+	switch (type) {
 		case VAL_SCALAR:
-			sprint_scalar(buf_x, val);
+			sprint_scalar(buf_x, SCX(val));
 			gvm_log("%s", buf_x);
 			break;
 		case VAL_VEC2:
@@ -384,9 +438,9 @@ static FixedPoint scan_fixed(const char *str)
 
 // Deserialises str to scalar
 // Silently returns zero on error; clamps if out of range
-GvmConstant scan_scalar(const char *str)
+FixedPoint scan_scalar(const char *str)
 {
-	return scalar(scan_fixed(str));
+	return scan_fixed(str);
 }
 
 GvmConstant scan_vec2(const char *str_x, const char *str_y)
@@ -395,9 +449,9 @@ GvmConstant scan_vec2(const char *str_x, const char *str_y)
 }
 
 // Converts double to scalar, clamping if out of range
-GvmConstant double_to_scalar(double x)
+FixedPoint double_to_scalar(double x)
 {
-	return scalar(double_to_fixed(x));
+	return double_to_fixed(x);
 }
 
 GvmConstant double_to_vec2(double x, double y)
@@ -405,7 +459,13 @@ GvmConstant double_to_vec2(double x, double y)
 	return vec2(double_to_fixed(x), double_to_fixed(y));
 }
 
-GvmConstant int_to_scalar(int x)
+FixedPoint int_to_scalar(int x)
+{
+	return int_to_fixed(x);
+}
+
+// Wraps a scalar for heterogeneous storage, e.g. the state table
+GvmConstant scalar_to_constant(FixedPoint x)
 {
-	return scalar(int_to_fixed(x));
+	return scalar(x);
 }
@@ -2,56 +2,68 @@
 #define VALUE_H
 
 #include "common.h"
-
-typedef int64_t FixedPoint;
+#include "fixed.h"
 
 typedef enum {
 	VAL_SCALAR,
 	VAL_VEC2,
 } ValueType;
 
+// Untagged: every value's type is known statically by the parser, so the VM
+// never needs to ask. Keep it that way - this is 16 bytes on every state slot.
 typedef struct {
 	union {
 		FixedPoint scalar;
 		FixedPoint vec2[2];
 	} as;
-	ValueType type;
 } GvmConstant;
 
-GvmConstant add_vals(GvmConstant a, GvmConstant b);
-GvmConstant subtract_vals(GvmConstant a, GvmConstant b);
-GvmConstant multiply_vals(GvmConstant a, GvmConstant b);
-GvmConstant divide_vals(GvmConstant a, GvmConstant b);
-GvmConstant rand_val(GvmConstant *seed);
-GvmConstant rand_int_val(GvmConstant max, GvmConstant *seed);
-GvmConstant floor_val(GvmConstant from, GvmConstant snap);
-GvmConstant ceil_val(GvmConstant from, GvmConstant snap);
-GvmConstant floor_val_ex(GvmConstant from, GvmConstant snap);
-GvmConstant ceil_val_ex(GvmConstant from, GvmConstant snap);
-bool val_less_than(GvmConstant a, GvmConstant b);
-bool val_greater_than(GvmConstant a, GvmConstant b);
-bool val_equal(GvmConstant a, GvmConstant b);
-GvmConstant val_modulus(GvmConstant a, GvmConstant b);
-GvmConstant val_vec2_get_x(GvmConstant v);
-GvmConstant val_vec2_get_y(GvmConstant v);
-GvmConstant val_vec2_make(GvmConstant x, GvmConstant y);
+// Scalars travel as bare FixedPoints; only vec2s (and heterogeneous storage
+// like the state table) need the full GvmConstant
+FixedPoint add_scalars(FixedPoint a, FixedPoint b);
+GvmConstant add_vec2s(GvmConstant a, GvmConstant b);
+FixedPoint subtract_scalars(FixedPoint a, FixedPoint b);
+GvmConstant subtract_vec2s(GvmConstant a, GvmConstant b);
+FixedPoint multiply_scalars(FixedPoint a, FixedPoint b);
+GvmConstant multiply_vec2s(GvmConstant a, GvmConstant b);
+FixedPoint divide_scalars(FixedPoint a, FixedPoint b);
+GvmConstant divide_vec2s(GvmConstant a, GvmConstant b);
+FixedPoint rand_val(FixedPoint *seed);
+FixedPoint rand_int_val(FixedPoint max, FixedPoint *seed);
+FixedPoint floor_val(FixedPoint from, FixedPoint snap);
+FixedPoint ceil_val(FixedPoint from, FixedPoint snap);
+FixedPoint floor_val_ex(FixedPoint from, FixedPoint snap);
+FixedPoint ceil_val_ex(FixedPoint from, FixedPoint snap);
+bool val_less_than(FixedPoint a, FixedPoint b);
+bool val_greater_than(FixedPoint a, FixedPoint b);
+bool val_equal(FixedPoint a, FixedPoint b);
+FixedPoint val_modulus(FixedPoint a, FixedPoint b);
+FixedPoint val_vec2_get_x(GvmConstant v);
+FixedPoint val_vec2_get_y(GvmConstant v);
+GvmConstant val_vec2_make(FixedPoint x, FixedPoint y);
 GvmConstant val_vec2_normalize(GvmConstant v);
-GvmConstant val_falsify(GvmConstant b);
-GvmConstant val_and(GvmConstant a, GvmConstant b);
-GvmConstant val_or(GvmConstant a, GvmConstant b);
+FixedPoint val_sin(FixedPoint angle);
+FixedPoint val_cos(FixedPoint angle);
+FixedPoint val_vec2_angle(GvmConstant v);
+FixedPoint val_vec2_length(GvmConstant v);
+GvmConstant val_vec2_rotate(GvmConstant v, FixedPoint angle);
+FixedPoint val_falsify(FixedPoint b);
+FixedPoint val_and(FixedPoint a, FixedPoint b);
+FixedPoint val_or(FixedPoint a, FixedPoint b);
 
-void sprint_scalar(char *buffer, GvmConstant value);
+void sprint_scalar(char *buffer, FixedPoint value);
 void sprint_vec2_x(char *buffer, GvmConstant value);
 void sprint_vec2_y(char *buffer, GvmConstant value);
-void print_value(GvmConstant val);
+void print_value(GvmConstant val, ValueType type);
 
 int vec2_get_x(GvmConstant v);
 int vec2_get_y(GvmConstant v);
 
-GvmConstant scan_scalar(const char *str);
+FixedPoint scan_scalar(const char *str);
 GvmConstant scan_vec2(const char *str_x, const char *str_y);
-GvmConstant double_to_scalar(double x);
+FixedPoint double_to_scalar(double x);
 GvmConstant double_to_vec2(double x, double y);
-GvmConstant int_to_scalar(int x);
+FixedPoint int_to_scalar(int x);
+GvmConstant scalar_to_constant(FixedPoint x);
 
 #endif // VALUE_H
@@ -1,3 +1,6 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -13,7 +16,11 @@
 
 #define INSTRUCTIONS_INITIAL_SIZE 256
 
-struct VM vm;
+_Thread_local struct VM vm;
+static GvmMapChunk empty_chunk;
+// The running VM, while a reload builds another on this thread: a map set
+// the same size as its map starts as a copy of it
+static _Thread_local const struct VM *map_seed = NULL;
 char *queued_load_path = NULL;
 bool will_save_state = false;
 bool will_reload = false;
@@ -26,287 +33,913 @@ static void runtime_error(const char *message)
 	}
 }
 
-// Returns: bitfield of the map at given position (as pixel coordinates)
-static bool get_map_flags(GvmConstant position)
+// Collision works on raw FixedPoint axes with the fixed.h primitives, so
+// positions come out bit-identical to doing the same sums through value.h
+#define GRID int_to_fixed(SPRITE_SZ)
+#define NO_IMPACT int_to_fixed(INT32_MAX) // time of impact if there's no boundary ahead
+
+// Returns: index of the tile under a pixel coordinate, or -1 if it's off a
+// map that many tiles long
+static int64_t tile_at(FixedPoint position, uint32_t n_tiles)
 {
-	int x = vec2_get_x(position);
-	int y = vec2_get_y(position);
-	if (x < 0 || vm.map_width * SPRITE_SZ <= x || y < 0 || vm.map_height * SPRITE_SZ <= y) {
-		return 0;
+	if (position < 0 || position / GRID >= n_tiles) {
+		return -1;
 	} else {
-		int map_x = x / SPRITE_SZ;
-		int map_y = y / SPRITE_SZ;
-		uint16_t sprite = vm.map[map_x + vm.map_width * map_y];
-		return vm.sprite_flags[sprite];
+		return position / GRID;
 	}
 }
 
-// Helper: checks if the given quad is sliding against a map tile with flags
-// matching the given bit. Checks for x-sliding if !transpose, else y-sliding.
-static bool is_sliding_1d(GvmConstant position, GvmConstant size, GvmConstant velocity, uint8_t bit, bool transpose)
+// Returns: the SPRITE_SZ cell a pixel coordinate lies in, rounding down
+static inline int64_t cell_at(FixedPoint position)
 {
-	GvmConstant (*get_x)(GvmConstant) = transpose ? val_vec2_get_y : val_vec2_get_x;
-	GvmConstant (*get_y)(GvmConstant) = transpose ? val_vec2_get_x : val_vec2_get_y;
+	return position >= 0 ? position / GRID : -((-position - 1) / GRID) - 1;
+}
 
-	// Horizontal sliding is determined by vertical movement and vice-versa
-	GvmConstant v = get_y(velocity);
-	GvmConstant x0 = get_x(position);
-	GvmConstant y0 = get_y(position);
-	GvmConstant x1 = add_vals(x0, get_x(size));
-	GvmConstant y1 = add_vals(y0, get_y(size));
-
-	GvmConstant zero = int_to_scalar(0);
-	GvmConstant grid = int_to_scalar(SPRITE_SZ);
-
-	if (val_less_than(v, zero)) {
-		GvmConstant boundary = floor_val(y0, grid);
-		if (val_equal(y0, boundary)) {
-			GvmConstant map_y = subtract_vals(y0, grid);
-			for (GvmConstant map_x = floor_val(x0, grid); val_less_than(map_x, x1); map_x = add_vals(map_x, grid)) {
-				GvmConstant map_position = val_vec2_make(transpose ? map_y : map_x, transpose ? map_x : map_y);
-				uint8_t flags = get_map_flags(map_position);
-				if ((bit & flags) != 0) {
-					return true;
-				}
+// Returns: one word of a row of a flag's bitmap, covering tiles
+// [64 * word, 64 * word + 64) along it
+static inline uint64_t map_word(uint8_t flag, uint32_t row, uint32_t word)
+{
+	return vm.map_chunks[(row / MAP_CHUNK_SZ) * vm.map_chunks_wide + word]->rows[flag][row % MAP_CHUNK_SZ];
+}
+
+// Returns: whether the map tile at given indices, which must be on the map,
+// has the flag, whatever its shape
+static inline bool tile_has_flag(int64_t map_x, int64_t map_y, uint8_t flag)
+{
+	const GvmMapChunk *chunk = map_chunk_at(map_x, map_y);
+	int tile = map_chunk_tile(map_x, map_y);
+	return (chunk->rows[flag][map_y % MAP_CHUNK_SZ] >> (map_x % MAP_CHUNK_SZ)) & 1
+		|| (NULL != chunk->shaped && (chunk->shaped->flags[tile] >> flag) & 1);
+}
+
+// Returns: whether the map tile at given position (as pixel coordinates) has
+// the flag
+static bool map_has_flag(FixedPoint x, FixedPoint y, uint8_t flag)
+{
+	int64_t map_x = tile_at(x, vm.map_width);
+	int64_t map_y = tile_at(y, vm.map_height);
+	if (map_x < 0 || map_y < 0) {
+		return false;
+	}
+
+	return tile_has_flag(map_x, map_y, flag);
+}
+
+// Returns: whether any tile overlapping [x0, x1) along the map line at y has
+// the flag. Scans a column instead of a row if transpose.
+static bool map_span_has_flag(FixedPoint y, FixedPoint x0, FixedPoint x1, uint8_t flag, bool transpose)
+{
+	uint32_t n_lines = transpose ? vm.map_width : vm.map_height;
+	uint32_t line_length = transpose ? vm.map_height : vm.map_width;
+	int64_t line = tile_at(y, n_lines);
+	if (line < 0 || x1 <= 0) {
+		return false;
+	}
+
+	int64_t first = x0 < 0 ? 0 : x0 / GRID;
+	int64_t last = (x1 - 1) / GRID;
+	if (last >= line_length) {
+		last = line_length - 1;
+	}
+	if (first > last) {
+		return false;
+	}
+
+	if (transpose) {
+		// Rows are all that's stored, so a column is read a tile at a time
+		for (int64_t row = first; row <= last; ++row) {
+			if ((map_word(flag, row, line / 64) >> (line % 64)) & 1) {
+				return true;
 			}
-			return false;
-		} else {
-			return false;
 		}
-	} else if (val_greater_than(v, zero)) {
-		GvmConstant boundary = ceil_val(y1, grid);
-		if (val_equal(y1, boundary)) {
-			GvmConstant map_y = y1;
-			for (GvmConstant map_x = floor_val(x0, grid); val_less_than(map_x, x1); map_x = add_vals(map_x, grid)) {
-				GvmConstant map_position = val_vec2_make(transpose ? map_y : map_x, transpose ? map_x : map_y);
-				uint8_t flags = get_map_flags(map_position);
-				if ((bit & flags) != 0) {
-					return true;
-				}
-			}
+		return false;
+	}
+
+	int64_t first_word = first / 64;
+	int64_t last_word = last / 64;
+	uint64_t first_mask = ~UINT64_C(0) << (first % 64);
+	uint64_t last_mask = ~UINT64_C(0) >> (63 - last % 64);
+	if (first_word == last_word) {
+		return (map_word(flag, line, first_word) & first_mask & last_mask) != 0;
+	}
+
+	if ((map_word(flag, line, first_word) & first_mask) != 0) {
+		return true;
+	}
+	for (int64_t i = first_word + 1; i < last_word; ++i) {
+		if (map_word(flag, line, i) != 0) {
+			return true;
+		}
+	}
+	return (map_word(flag, line, last_word) & last_mask) != 0;
+}
+
+// Helper: checks if the given quad is sliding against a map tile with the
+// given flag. Arguments are along the sliding axis (x) and the axis of motion
+// (y): pass them transposed, with transpose set, for y-sliding.
+static inline bool is_sliding_1d(FixedPoint x0, FixedPoint y0, FixedPoint w, FixedPoint h, FixedPoint v, uint8_t flag, bool transpose)
+{
+	// Horizontal sliding is determined by vertical movement and vice-versa
+	FixedPoint map_y;
+	if (v < 0) {
+		if (y0 != floor_raw(y0, GRID)) {
 			return false;
-		} else {
+		}
+		map_y = fixed_subtract(y0, GRID);
+	} else if (v > 0) {
+		FixedPoint y1 = fixed_add(y0, h);
+		if (y1 != floor_raw(y1 + GRID - 1, GRID)) {
 			return false;
 		}
+		map_y = y1;
 	} else {
 		// Even if we're on a grid boundary, no vertical movement means no slide
 		return false;
 	}
-}
 
-static bool is_sliding_x(GvmConstant position, GvmConstant size, GvmConstant velocity, uint8_t bit)
-{
-	return is_sliding_1d(position, size, velocity, bit, false);
+	return map_span_has_flag(map_y, x0, fixed_add(x0, w), flag, transpose);
 }
 
-static bool is_sliding_y(GvmConstant position, GvmConstant size, GvmConstant velocity, uint8_t bit)
+// Returns: the nearest grid boundary above position. floor_raw() snaps
+// negative multiples down a further step, which would otherwise give position
+// itself here - and moving there takes no time, so move_collide() would never
+// get anywhere.
+static inline FixedPoint boundary_above(FixedPoint position)
 {
-	return is_sliding_1d(position, size, velocity, bit, true);
+	FixedPoint boundary = floor_raw(position + GRID, GRID);
+	return boundary > position ? boundary : boundary + GRID;
 }
 
 // Moves position to the next grid boundary
 // Returns: time of impact (or very big value if it never hits one), and places
-// position of impact in out_position
-static GvmConstant move_to_boundary(GvmConstant position, GvmConstant size, GvmConstant velocity, GvmConstant *out_position)
+// position of impact in out_x, out_y
+static inline FixedPoint move_to_boundary(FixedPoint x0, FixedPoint y0, FixedPoint w, FixedPoint h, FixedPoint vx, FixedPoint vy, FixedPoint *out_x, FixedPoint *out_y)
 {
-	GvmConstant zero = int_to_scalar(0);
-	GvmConstant grid = int_to_scalar(SPRITE_SZ);
-
-	GvmConstant x0 = val_vec2_get_x(position);
-	GvmConstant y0 = val_vec2_get_y(position);
-	GvmConstant w = val_vec2_get_x(size);
-	GvmConstant h = val_vec2_get_y(size);
-	GvmConstant x1 = add_vals(x0, w);
-	GvmConstant y1 = add_vals(y0, h);
-	GvmConstant vx = val_vec2_get_x(velocity);
-	GvmConstant vy = val_vec2_get_y(velocity);
+	// If we calculated position + toi * velocity, we might not end up exactly
+	// on a grid boundary since division and multiplication are not necessarily
+	// inverse operations. That's why we find where each axis hits directly.
 
 	// Time to boundary along x-axis
-	GvmConstant tx = int_to_scalar(INT32_MAX);
-	GvmConstant pos_x = position;
-	if (val_less_than(vx, zero)) {
-		GvmConstant lead_x = floor_val_ex(x0, grid);
-		tx = divide_vals(subtract_vals(lead_x, x0), vx);
-		GvmConstant pos_x_y = add_vals(y0, multiply_vals(vy, tx));
-		pos_x = val_vec2_make(lead_x, pos_x_y);
-	} else if (val_greater_than(vx, zero)) {
-		GvmConstant lead_x = ceil_val_ex(x1, grid);
-		tx = divide_vals(subtract_vals(lead_x, x1), vx);
-		GvmConstant pos_x_y = add_vals(y0, multiply_vals(vy, tx));
-		pos_x = val_vec2_make(subtract_vals(lead_x, w), pos_x_y);
+	FixedPoint tx = NO_IMPACT;
+	FixedPoint pos_x_x = x0;
+	FixedPoint pos_x_y = y0;
+	if (vx < 0) {
+		FixedPoint lead_x = floor_raw(x0 - 1, GRID);
+		tx = fixed_divide(fixed_subtract(lead_x, x0), vx);
+		pos_x_x = lead_x;
+		pos_x_y = fixed_add(y0, fixed_multiply(vy, tx));
+	} else if (vx > 0) {
+		FixedPoint x1 = fixed_add(x0, w);
+		FixedPoint lead_x = boundary_above(x1);
+		tx = fixed_divide(fixed_subtract(lead_x, x1), vx);
+		pos_x_x = fixed_subtract(lead_x, w);
+		pos_x_y = fixed_add(y0, fixed_multiply(vy, tx));
 	}
 
 	// Time to boundary along y-axis
-	GvmConstant ty = int_to_scalar(INT32_MAX);
-	GvmConstant pos_y = position;
-	if (val_less_than(vy, zero)) {
-		GvmConstant lead_y = floor_val_ex(y0, grid);
-		ty = divide_vals(subtract_vals(lead_y, y0), vy);
-		GvmConstant pos_y_x = add_vals(x0, multiply_vals(vx, ty));
-		pos_y = val_vec2_make(pos_y_x, lead_y);
-	} else if (val_greater_than(vy, zero)) {
-		GvmConstant lead_y = ceil_val_ex(y1, grid);
-		ty = divide_vals(subtract_vals(lead_y, y1), vy);
-		GvmConstant pos_y_x = add_vals(x0, multiply_vals(vx, ty));
-		pos_y = val_vec2_make(pos_y_x, subtract_vals(lead_y, h));
-	}
-
-	GvmConstant toi = val_less_than(tx, ty) ? tx : ty;
-	// If we calculated position + toi * velocity, we might not end up exactly
-	// on a grid boundary since division and multiplication are not necessarily
-	// inverse operations. That's why we calculate pos_x and pos_y earlier.
-	*out_position = val_less_than(tx, ty) ? pos_x : pos_y;
-	return toi;
+	FixedPoint ty = NO_IMPACT;
+	FixedPoint pos_y_x = x0;
+	FixedPoint pos_y_y = y0;
+	if (vy < 0) {
+		FixedPoint lead_y = floor_raw(y0 - 1, GRID);
+		ty = fixed_divide(fixed_subtract(lead_y, y0), vy);
+		pos_y_x = fixed_add(x0, fixed_multiply(vx, ty));
+		pos_y_y = lead_y;
+	} else if (vy > 0) {
+		FixedPoint y1 = fixed_add(y0, h);
+		FixedPoint lead_y = boundary_above(y1);
+		ty = fixed_divide(fixed_subtract(lead_y, y1), vy);
+		pos_y_x = fixed_add(x0, fixed_multiply(vx, ty));
+		pos_y_y = fixed_subtract(lead_y, h);
+	}
+
+	if (tx < ty) {
+		*out_x = pos_x_x;
+		*out_y = pos_x_y;
+		return tx;
+	} else {
+		*out_x = pos_y_x;
+		*out_y = pos_y_y;
+		return ty;
+	}
 }
 
 // Helper: moves x0 until x0 or (x0 + w) hits a grid boundary
-// All arguments are scalars
 // Returns: time of impact, and places position of impact in out_position
-static GvmConstant slide_to_boundary_1d(GvmConstant x0, GvmConstant w, GvmConstant v, GvmConstant *out_position)
+static inline FixedPoint slide_to_boundary_1d(FixedPoint x0, FixedPoint w, FixedPoint v, FixedPoint *out_position)
 {
-	GvmConstant x1 = add_vals(x0, w);
-	GvmConstant zero = int_to_scalar(0);
-	GvmConstant grid = int_to_scalar(SPRITE_SZ);
-
-	if (val_less_than(v, zero)) {
-		GvmConstant t0 = divide_vals(subtract_vals(floor_val_ex(x0, grid), x0), v);
-		GvmConstant t1 = divide_vals(subtract_vals(floor_val_ex(x1, grid), x1), v);
-		if (val_less_than(t0, t1)) {
-			*out_position = floor_val_ex(x0, grid);
+	FixedPoint x1 = fixed_add(x0, w);
+
+	if (v < 0) {
+		FixedPoint lead_0 = floor_raw(x0 - 1, GRID);
+		FixedPoint lead_1 = floor_raw(x1 - 1, GRID);
+		FixedPoint t0 = fixed_divide(fixed_subtract(lead_0, x0), v);
+		FixedPoint t1 = fixed_divide(fixed_subtract(lead_1, x1), v);
+		if (t0 < t1) {
+			*out_position = lead_0;
 			return t0;
 		} else {
-			*out_position = subtract_vals(floor_val_ex(x1, grid), w);
+			*out_position = fixed_subtract(lead_1, w);
 			return t1;
 		}
-	} else if (val_greater_than(v, zero)) {
-		GvmConstant t0 = divide_vals(subtract_vals(ceil_val_ex(x0, grid), x0), v);
-		GvmConstant t1 = divide_vals(subtract_vals(ceil_val_ex(x1, grid), x1), v);
-		if (val_less_than(t0, t1)) {
-			*out_position = ceil_val_ex(x0, grid);
+	} else if (v > 0) {
+		FixedPoint lead_0 = boundary_above(x0);
+		FixedPoint lead_1 = boundary_above(x1);
+		FixedPoint t0 = fixed_divide(fixed_subtract(lead_0, x0), v);
+		FixedPoint t1 = fixed_divide(fixed_subtract(lead_1, x1), v);
+		if (t0 < t1) {
+			*out_position = lead_0;
 			return t0;
 		} else {
-			*out_position = subtract_vals(ceil_val_ex(x1, grid), w);
+			*out_position = fixed_subtract(lead_1, w);
 			return t1;
 		}
 	} else {
 		*out_position = x0;
-		return int_to_scalar(INT32_MAX);
+		return NO_IMPACT;
 	}
 }
 
-// All arguments are vec2s
-// Returns: time of impact, and places position of impact in out_position
-static GvmConstant slide_to_boundary_x(GvmConstant position, GvmConstant size, GvmConstant velocity, GvmConstant *out_position)
+// Returns: height of a slope's surface over pixel column px, clamped to the
+// tile
+static FixedPoint slope_surface(uint8_t shape, int64_t tile_x, int64_t tile_y, FixedPoint px)
+{
+	FixedPoint left = tile_x * GRID;
+	FixedPoint along = px < left ? 0 : px > left + GRID ? GRID : px - left;
+	return SHAPE_SLOPE_UP == shape ? (tile_y + 1) * GRID - along : tile_y * GRID + along;
+}
+
+// The sweep only sees full tiles. After it, this settles a body that went
+// from (x0, y0) to (x, y) against shaped ones: first it's lifted onto the
+// highest floor (slope, half tile or one-way top) that it was on or above
+// before and has come down through, then pushed back out of any half tile it
+// ran into from below or the side. Assumes a non-negative size.
+static void resolve_shapes(FixedPoint x0, FixedPoint y0, FixedPoint w, FixedPoint h, FixedPoint *x, FixedPoint *y, uint8_t flag)
+{
+	// Tiles under the body where it ended, and up to where it started
+	// vertically, so fast falls can't skip a floor
+	FixedPoint top = *y < y0 ? *y : y0;
+	FixedPoint bottom = fixed_add(*y > y0 ? *y : y0, h);
+	int64_t tile_x_lo = cell_at(*x);
+	int64_t tile_x_hi = w > 0 ? cell_at(fixed_add(*x, w) - 1) : tile_x_lo;
+	int64_t tile_y_lo = cell_at(top);
+	int64_t tile_y_hi = bottom > top ? cell_at(bottom - 1) : tile_y_lo;
+	tile_x_lo = tile_x_lo < 0 ? 0 : tile_x_lo;
+	tile_y_lo = tile_y_lo < 0 ? 0 : tile_y_lo;
+	tile_x_hi = tile_x_hi >= vm.map_width ? (int64_t)vm.map_width - 1 : tile_x_hi;
+	tile_y_hi = tile_y_hi >= vm.map_height ? (int64_t)vm.map_height - 1 : tile_y_hi;
+
+	FixedPoint floor = FP_MAX;
+	for (int64_t tile_y = tile_y_lo; tile_y <= tile_y_hi; ++tile_y) {
+		for (int64_t tile_x = tile_x_lo; tile_x <= tile_x_hi; ++tile_x) {
+			const GvmShapedTiles *shaped = map_chunk_at(tile_x, tile_y)->shaped;
+			if (NULL == shaped) {
+				continue;
+			}
+			int tile = map_chunk_tile(tile_x, tile_y);
+			uint8_t shape = shaped->shapes[tile];
+			if (SHAPE_FULL == shape || !((shaped->flags[tile] >> flag) & 1)) {
+				continue;
+			}
+
+			// Slopes are sampled under whichever bottom corner is uphill
+			FixedPoint surface = tile_y * GRID;
+			FixedPoint was_surface = surface;
+			if (SHAPE_SLOPE_UP == shape) {
+				surface = slope_surface(shape, tile_x, tile_y, fixed_add(*x, w));
+				was_surface = slope_surface(shape, tile_x, tile_y, fixed_add(x0, w));
+			} else if (SHAPE_SLOPE_DOWN == shape) {
+				surface = slope_surface(shape, tile_x, tile_y, *x);
+				was_surface = slope_surface(shape, tile_x, tile_y, x0);
+			} else if (SHAPE_BOTTOM_HALF == shape) {
+				surface += GRID / 2;
+				was_surface = surface;
+			}
+
+			if (fixed_add(y0, h) <= was_surface && fixed_add(*y, h) > surface && surface < floor) {
+				floor = surface;
+			}
+		}
+	}
+	if (floor != FP_MAX) {
+		*y = fixed_subtract(floor, h);
+	}
+
+	for (int64_t tile_y = tile_y_lo; tile_y <= tile_y_hi; ++tile_y) {
+		for (int64_t tile_x = tile_x_lo; tile_x <= tile_x_hi; ++tile_x) {
+			const GvmShapedTiles *shaped = map_chunk_at(tile_x, tile_y)->shaped;
+			if (NULL == shaped) {
+				continue;
+			}
+			int tile = map_chunk_tile(tile_x, tile_y);
+			uint8_t shape = shaped->shapes[tile];
+			if ((SHAPE_BOTTOM_HALF != shape && SHAPE_TOP_HALF != shape) || !((shaped->flags[tile] >> flag) & 1)) {
+				continue;
+			}
+
+			FixedPoint box_x0 = tile_x * GRID;
+			FixedPoint box_x1 = box_x0 + GRID;
+			FixedPoint box_y0 = tile_y * GRID + (SHAPE_BOTTOM_HALF == shape ? GRID / 2 : 0);
+			FixedPoint box_y1 = box_y0 + GRID / 2;
+			if (!(*x < box_x1 && box_x0 < fixed_add(*x, w) && *y < box_y1 && box_y0 < fixed_add(*y, h))) {
+				continue;
+			}
+			// From above was the floor; if it started inside, leave it be
+			if (y0 >= box_y1) {
+				*y = box_y1;
+			} else if (fixed_add(x0, w) <= box_x0) {
+				*x = fixed_subtract(box_x0, w);
+			} else if (x0 >= box_x1) {
+				*x = box_x1;
+			}
+		}
+	}
+}
+
+static GvmConstant move_collide(GvmConstant position, GvmConstant size, GvmConstant velocity, uint8_t flag)
 {
-	GvmConstant out_1d;
-	GvmConstant toi = slide_to_boundary_1d(val_vec2_get_x(position), val_vec2_get_x(size), val_vec2_get_x(velocity), &out_1d);
-	*out_position = val_vec2_make(out_1d, val_vec2_get_y(position));
-	return toi;
+	FixedPoint x = position.as.vec2[0];
+	FixedPoint y = position.as.vec2[1];
+	FixedPoint w = size.as.vec2[0];
+	FixedPoint h = size.as.vec2[1];
+	FixedPoint vx = velocity.as.vec2[0];
+	FixedPoint vy = velocity.as.vec2[1];
+	FixedPoint t = int_to_fixed(1);
+
+	while (t > 0) {
+		bool sliding_x = is_sliding_1d(x, y, w, h, vy, flag, false);
+		bool sliding_y = is_sliding_1d(y, x, h, w, vx, flag, true);
+		FixedPoint toi;
+
+		if (sliding_x && sliding_y) {
+			break;
+		} else if (sliding_x) {
+			FixedPoint next_x;
+			toi = slide_to_boundary_1d(x, w, vx, &next_x);
+			x = toi > t ? fixed_add(x, fixed_multiply(vx, t)) : next_x;
+		} else if (sliding_y) {
+			FixedPoint next_y;
+			toi = slide_to_boundary_1d(y, h, vy, &next_y);
+			y = toi > t ? fixed_add(y, fixed_multiply(vy, t)) : next_y;
+		} else {
+			FixedPoint next_x, next_y;
+			toi = move_to_boundary(x, y, w, h, vx, vy, &next_x, &next_y);
+			if (toi > t) {
+				x = fixed_add(x, fixed_multiply(vx, t));
+				y = fixed_add(y, fixed_multiply(vy, t));
+			} else {
+				x = next_x;
+				y = next_y;
+			}
+		}
+		t = fixed_subtract(t, toi);
+	}
+
+	if (vm.map_shaped_tiles[flag] > 0 && w >= 0 && h >= 0) {
+		resolve_shapes(position.as.vec2[0], position.as.vec2[1], w, h, &x, &y, flag);
+	}
+	return val_vec2_make(x, y);
 }
 
-static GvmConstant slide_to_boundary_y(GvmConstant position, GvmConstant size, GvmConstant velocity, GvmConstant *out_position)
+static inline uint32_t cell_bucket(int64_t cell_x, int64_t cell_y)
 {
-	GvmConstant out_1d;
-	GvmConstant toi = slide_to_boundary_1d(val_vec2_get_y(position), val_vec2_get_y(size), val_vec2_get_y(velocity), &out_1d);
-	*out_position = val_vec2_make(val_vec2_get_x(position), out_1d);
-	return toi;
+	uint64_t hash = (uint64_t)cell_x * 0x9E3779B97F4A7C15u ^ (uint64_t)cell_y * 0xC2B2AE3D27D4EB4Fu;
+	return (hash >> 32) & (ENTITY_BUCKETS - 1);
 }
 
-// Returns: position + t * [velocity.x, 0]
-static GvmConstant slide_no_collide_x(GvmConstant position, GvmConstant velocity, GvmConstant t)
+// Returns: whether two sets of pixel bounds overlap. Touching edges don't.
+static inline bool bounds_overlap(const GvmEntity *a, FixedPoint x0, FixedPoint y0, FixedPoint x1, FixedPoint y1)
 {
-	GvmConstant displacement = multiply_vals(val_vec2_get_x(velocity), t);
-	return val_vec2_make(add_vals(val_vec2_get_x(position), displacement), val_vec2_get_y(position));
+	return a->x0 < x1 && x0 < a->x1 && a->y0 < y1 && y0 < a->y1;
 }
 
-static GvmConstant slide_no_collide_y(GvmConstant position, GvmConstant velocity, GvmConstant t)
+// Places the cells spanned by [x0, x1) x [y0, y1) in out_*, inclusive
+// Returns: how many cells that is, saturating well above anything hashable
+static uint64_t cell_span(FixedPoint x0, FixedPoint y0, FixedPoint x1, FixedPoint y1, int64_t *out_x0, int64_t *out_y0, int64_t *out_x1, int64_t *out_y1)
 {
-	GvmConstant displacement = multiply_vals(val_vec2_get_y(velocity), t);
-	return val_vec2_make(val_vec2_get_x(position), add_vals(val_vec2_get_y(position), displacement));
+	*out_x0 = cell_at(x0);
+	*out_y0 = cell_at(y0);
+	*out_x1 = x1 > x0 ? cell_at(x1 - 1) : *out_x0;
+	*out_y1 = y1 > y0 ? cell_at(y1 - 1) : *out_y0;
+	return (uint64_t)(*out_x1 - *out_x0 + 1) * (uint64_t)(*out_y1 - *out_y0 + 1);
 }
 
-// Returns: position + t * velocity
-static GvmConstant move_no_collide(GvmConstant position, GvmConstant velocity, GvmConstant t)
+// Returns: index of the new entity, or -1 if the table's full
+static int add_entity(GvmConstant position, GvmConstant size, uint8_t layer)
 {
-	GvmConstant displacement = multiply_vals(velocity, val_vec2_make(t, t));
-	return add_vals(position, displacement);
+	if (vm.entity_count >= MAX_ENTITIES) {
+		return -1;
+	}
+
+	// Sizes may be negative: store whichever corner is least
+	FixedPoint x = position.as.vec2[0];
+	FixedPoint y = position.as.vec2[1];
+	FixedPoint x_end = fixed_add(x, size.as.vec2[0]);
+	FixedPoint y_end = fixed_add(y, size.as.vec2[1]);
+	GvmEntity *entity = &vm.entities[vm.entity_count];
+	entity->x0 = x < x_end ? x : x_end;
+	entity->x1 = x < x_end ? x_end : x;
+	entity->y0 = y < y_end ? y : y_end;
+	entity->y1 = y < y_end ? y_end : y;
+	entity->layer = layer;
+	vm.entity_hash_stale = true;
+	return vm.entity_count++;
 }
 
-static GvmConstant move_collide(GvmConstant position, GvmConstant size, GvmConstant velocity, uint8_t bit)
+// Counting sort of every small entity into the buckets of the cells it spans
+static void rebuild_entity_hash()
 {
-	GvmConstant t = int_to_scalar(1);
-	GvmConstant zero = int_to_scalar(0);
+	uint16_t cursor[ENTITY_BUCKETS];
+	memset(vm.entity_buckets, 0, sizeof(vm.entity_buckets));
+	vm.big_entity_count = 0;
+
+	for (uint32_t i = 0; i < vm.entity_count; ++i) {
+		GvmEntity *e = &vm.entities[i];
+		int64_t cx0, cy0, cx1, cy1;
+		if (cell_span(e->x0, e->y0, e->x1, e->y1, &cx0, &cy0, &cx1, &cy1) > ENTITY_MAX_CELLS) {
+			vm.big_entities[vm.big_entity_count++] = i;
+			continue;
+		}
+		for (int64_t cy = cy0; cy <= cy1; ++cy) {
+			for (int64_t cx = cx0; cx <= cx1; ++cx) {
+				++vm.entity_buckets[cell_bucket(cx, cy) + 1];
+			}
+		}
+	}
 
-	while (val_greater_than(t, zero)) {
-		bool sliding_x = is_sliding_x(position, size, velocity, bit);
-		bool sliding_y = is_sliding_y(position, size, velocity, bit);
-		GvmConstant (*to_boundary)(GvmConstant, GvmConstant, GvmConstant, GvmConstant *) = NULL;
-		GvmConstant (*no_collide)(GvmConstant, GvmConstant, GvmConstant) = NULL;
+	for (int b = 0; b < ENTITY_BUCKETS; ++b) {
+		vm.entity_buckets[b + 1] += vm.entity_buckets[b];
+		cursor[b] = vm.entity_buckets[b];
+	}
 
-		if (sliding_x && sliding_y) {
+	for (uint32_t i = 0; i < vm.entity_count; ++i) {
+		GvmEntity *e = &vm.entities[i];
+		int64_t cx0, cy0, cx1, cy1;
+		if (cell_span(e->x0, e->y0, e->x1, e->y1, &cx0, &cy0, &cx1, &cy1) > ENTITY_MAX_CELLS) {
+			continue;
+		}
+		for (int64_t cy = cy0; cy <= cy1; ++cy) {
+			for (int64_t cx = cx0; cx <= cx1; ++cx) {
+				vm.entity_cells[cursor[cell_bucket(cx, cy)]++] = i;
+			}
+		}
+	}
+
+	vm.entity_hash_stale = false;
+}
+
+// Finds every entity on the layer overlapping the given quad, leaving them in
+// vm.entity_hits
+// Returns: how many there were
+static uint32_t query_entities(GvmConstant position, GvmConstant size, uint8_t layer)
+{
+	if (vm.entity_hash_stale) {
+		rebuild_entity_hash();
+	}
+
+	FixedPoint x = position.as.vec2[0];
+	FixedPoint y = position.as.vec2[1];
+	FixedPoint x_end = fixed_add(x, size.as.vec2[0]);
+	FixedPoint y_end = fixed_add(y, size.as.vec2[1]);
+	FixedPoint x0 = x < x_end ? x : x_end;
+	FixedPoint x1 = x < x_end ? x_end : x;
+	FixedPoint y0 = y < y_end ? y : y_end;
+	FixedPoint y1 = y < y_end ? y_end : y;
+
+	// One bit per entity both dedupes those spanning several cells and sorts
+	uint64_t hit[MAX_ENTITIES / 64] = { 0 };
+#define TEST(index) \
+	do { \
+		uint8_t _i = (index); \
+		if (vm.entities[_i].layer == layer && bounds_overlap(&vm.entities[_i], x0, y0, x1, y1)) { \
+			hit[_i / 64] |= UINT64_C(1) << (_i % 64); \
+		} \
+	} while (0)
+
+	int64_t cx0, cy0, cx1, cy1;
+	if (cell_span(x0, y0, x1, y1, &cx0, &cy0, &cx1, &cy1) > ENTITY_BUCKETS) {
+		// Covers more cells than there are buckets: cheaper to test them all
+		for (uint32_t i = 0; i < vm.entity_count; ++i) {
+			TEST(i);
+		}
+	} else {
+		for (int64_t cy = cy0; cy <= cy1; ++cy) {
+			for (int64_t cx = cx0; cx <= cx1; ++cx) {
+				uint32_t bucket = cell_bucket(cx, cy);
+				for (uint32_t j = vm.entity_buckets[bucket]; j < vm.entity_buckets[bucket + 1]; ++j) {
+					TEST(vm.entity_cells[j]);
+				}
+			}
+		}
+		for (uint32_t j = 0; j < vm.big_entity_count; ++j) {
+			TEST(vm.big_entities[j]);
+		}
+	}
+
+#undef TEST
+
+	vm.entity_hit_count = 0;
+	for (int word = 0; word < MAX_ENTITIES / 64; ++word) {
+		for (uint64_t bits = hit[word]; bits; bits &= bits - 1) {
+			vm.entity_hits[vm.entity_hit_count++] = word * 64 + __builtin_ctzll(bits);
+		}
+	}
+	return vm.entity_hit_count;
+}
+
+// Returns: whether the tile at given indices is on the map and has the flag
+static bool tile_blocks(int64_t map_x, int64_t map_y, uint8_t flag)
+{
+	return 0 <= map_x && map_x < vm.map_width && 0 <= map_y && map_y < vm.map_height && tile_has_flag(map_x, map_y, flag);
+}
+
+// A time along a ray as an exact fraction of the segment, num / den with den
+// positive, or never if den is 0. Times are compared by cross-multiplying in
+// 128 bits, which FixedPoint products always fit, so no rounding can tip a
+// comparison one way on one platform and the other on another.
+typedef struct {
+	int64_t num;
+	int64_t den;
+} RayTime;
+
+#define RAY_END ((RayTime){ 1, 1 })
+
+// Returns: whether a comes strictly before b. Never comes after every time.
+static inline bool ray_time_less(RayTime a, RayTime b)
+{
+	return (__int128)a.num * b.den < (__int128)b.num * a.den;
+}
+
+// Returns: the time an axis starting at from and moving by d along the
+// segment reaches to, or never if it doesn't move
+static inline RayTime ray_time(FixedPoint from, FixedPoint to, FixedPoint d)
+{
+	if (d > 0) {
+		return (RayTime){ to - from, d };
+	} else if (d < 0) {
+		return (RayTime){ from - to, -d };
+	} else {
+		return (RayTime){ 1, 0 };
+	}
+}
+
+// Returns: where an axis starting at from and moving by d along the segment
+// is at time t, rounded towards from
+static inline FixedPoint ray_at(FixedPoint from, FixedPoint d, RayTime t)
+{
+	return from + (FixedPoint)((__int128)d * t.num / t.den);
+}
+
+// Walks the tiles under the segment from origin up to (not including) origin +
+// ray in order, per Amanatides & Woo, until one has the flag. Off-map tiles
+// never do, so the walk starts where the segment enters the map and stops
+// where it leaves.
+// Passing exactly through a corner, either tile beside it blocks, so there's
+// no seeing through diagonal cracks.
+// Returns: whether it hit, placing the point where the segment first touches
+// that tile in out_hit (or the end of the segment if there's no hit)
+static bool raycast(GvmConstant origin, GvmConstant ray, uint8_t flag, GvmConstant *out_hit)
+{
+	FixedPoint x = origin.as.vec2[0];
+	FixedPoint y = origin.as.vec2[1];
+	FixedPoint dx = ray.as.vec2[0];
+	FixedPoint dy = ray.as.vec2[1];
+	FixedPoint map_x1 = vm.map_width * GRID;
+	FixedPoint map_y1 = vm.map_height * GRID;
+	*out_hit = val_vec2_make(fixed_add(x, dx), fixed_add(y, dy));
+	if (0 == vm.map_width || 0 == vm.map_height) {
+		return false;
+	}
+
+	// A point on a tile boundary is placed exactly on it rather than through
+	// the time
+	RayTime t = { 0, 1 };
+	bool on_x = false;
+	bool on_y = false;
+	FixedPoint edge_x = 0;
+	FixedPoint edge_y = 0;
+
+	// Starting off the map, clip to it, remembering which edge we came in by
+	if (x < 0 || x >= map_x1 || y < 0 || y >= map_y1) {
+		RayTime t_exit = RAY_END;
+		if ((dx == 0 && (x < 0 || x >= map_x1)) || (dy == 0 && (y < 0 || y >= map_y1))) {
+			return false;
+		}
+		if (dx != 0) {
+			RayTime t_in = ray_time(x, dx > 0 ? 0 : map_x1, dx);
+			RayTime t_out = ray_time(x, dx > 0 ? map_x1 : 0, dx);
+			if (ray_time_less(t, t_in)) {
+				t = t_in;
+				on_x = true;
+				edge_x = dx > 0 ? 0 : map_x1;
+			}
+			t_exit = ray_time_less(t_out, t_exit) ? t_out : t_exit;
+		}
+		if (dy != 0) {
+			RayTime t_in = ray_time(y, dy > 0 ? 0 : map_y1, dy);
+			RayTime t_out = ray_time(y, dy > 0 ? map_y1 : 0, dy);
+			if (ray_time_less(t, t_in)) {
+				t = t_in;
+				on_x = false;
+				on_y = true;
+				edge_y = dy > 0 ? 0 : map_y1;
+			}
+			t_exit = ray_time_less(t_out, t_exit) ? t_out : t_exit;
+		}
+		if (!ray_time_less(t, t_exit)) {
+			return false;
+		}
+	}
+
+	// Rounding could put the entry point a hair off the map: clamp it on
+	int64_t tile_x = cell_at(on_x ? edge_x : ray_at(x, dx, t));
+	int64_t tile_y = cell_at(on_y ? edge_y : ray_at(y, dy, t));
+	tile_x = tile_x < 0 ? 0 : tile_x >= vm.map_width ? vm.map_width - 1 : tile_x;
+	tile_y = tile_y < 0 ? 0 : tile_y >= vm.map_height ? vm.map_height - 1 : tile_y;
+
+	int step_x = dx > 0 ? 1 : -1;
+	int step_y = dy > 0 ? 1 : -1;
+	while (!tile_has_flag(tile_x, tile_y, flag)) {
+		// Times of the next boundary on each axis. They're worked out afresh
+		// rather than accumulated, so a pass through a corner ties exactly.
+		FixedPoint next_x = (tile_x + (step_x > 0)) * GRID;
+		FixedPoint next_y = (tile_y + (step_y > 0)) * GRID;
+		RayTime t_x = ray_time(x, next_x, dx);
+		RayTime t_y = ray_time(y, next_y, dy);
+		on_x = !ray_time_less(t_y, t_x);
+		on_y = !ray_time_less(t_x, t_y);
+		t = on_x ? t_x : t_y;
+		edge_x = next_x;
+		edge_y = next_y;
+		if (!ray_time_less(t, RAY_END)) {
+			return false;
+		}
+		if (on_x && on_y && (tile_blocks(tile_x + step_x, tile_y, flag) || tile_blocks(tile_x, tile_y + step_y, flag))) {
 			break;
-		} else if (sliding_x) {
-			to_boundary = slide_to_boundary_x;
-			no_collide = slide_no_collide_x;
-		} else if (sliding_y) {
-			to_boundary = slide_to_boundary_y;
-			no_collide = slide_no_collide_y;
-		} else {
-			to_boundary = move_to_boundary;
-			no_collide = move_no_collide;
 		}
 
-		GvmConstant next_boundary;
-		GvmConstant toi = to_boundary(position, size, velocity, &next_boundary);
-		if (val_greater_than(toi, t)) {
-			position = no_collide(position, velocity, t);
-		} else {
-			position = next_boundary;
+		tile_x += on_x ? step_x : 0;
+		tile_y += on_y ? step_y : 0;
+		if (tile_x < 0 || tile_x >= vm.map_width || tile_y < 0 || tile_y >= vm.map_height) {
+			return false;
 		}
-		t = subtract_vals(t, toi);
 	}
 
-	return position;
+	FixedPoint hit_x = on_x ? edge_x : ray_at(x, dx, t);
+	FixedPoint hit_y = on_y ? edge_y : ray_at(y, dy, t);
+	*out_hit = val_vec2_make(hit_x, hit_y);
+	return true;
 }
 
-static GvmConstant peek()
+typedef enum {
+	FLOW_NONE, // unreachable, or blocked
+	FLOW_LEFT,
+	FLOW_RIGHT,
+	FLOW_UP,
+	FLOW_DOWN,
+	FLOW_ARRIVED,
+} FlowDirection;
+
+static void free_flow_fields(uint8_t flags)
 {
-	if (vm.stack_count <= 0) {
+	for (int i = 0; i < N_FLOW_FIELDS; ++i) {
+		if (NULL != vm.flow_fields[i].directions && (flags & (1u << vm.flow_fields[i].flag))) {
+			gvm_free(vm.flow_fields[i].directions);
+			vm.flow_fields[i].directions = NULL;
+		}
+	}
+}
+
+// Breadth-first from the target: every step costs the same, so this is
+// Dijkstra without the heap. Each tile points back the way it was reached.
+static bool fill_flow_field(GvmFlowField *field)
+{
+	if (NULL == vm.flow_queue) {
+		vm.flow_queue = gvm_malloc(sizeof(*vm.flow_queue) * FLOW_FIELD_SIDE * FLOW_FIELD_SIDE);
+		if (NULL == vm.flow_queue) {
+			return false;
+		}
+	}
+
+	// The square around the target, cut down to the map; empty if it's off it
+	int64_t x0 = field->target_x - FLOW_FIELD_RADIUS;
+	int64_t y0 = field->target_y - FLOW_FIELD_RADIUS;
+	int64_t x1 = field->target_x + FLOW_FIELD_RADIUS + 1;
+	int64_t y1 = field->target_y + FLOW_FIELD_RADIUS + 1;
+	x0 = x0 < 0 ? 0 : x0 > vm.map_width ? vm.map_width : x0;
+	y0 = y0 < 0 ? 0 : y0 > vm.map_height ? vm.map_height : y0;
+	x1 = x1 < x0 ? x0 : x1 > vm.map_width ? vm.map_width : x1;
+	y1 = y1 < y0 ? y0 : y1 > vm.map_height ? vm.map_height : y1;
+	field->x0 = x0;
+	field->y0 = y0;
+	field->width = x1 - x0;
+	field->height = y1 - y0;
+
+	uint32_t width = field->width;
+	uint32_t height = field->height;
+	uint16_t *queue = vm.flow_queue;
+	memset(field->directions, FLOW_NONE, (size_t)width * height);
+	uint8_t *directions = field->directions;
+	uint32_t head = 0;
+	uint32_t tail = 0;
+	if (0 <= field->target_x && field->target_x < vm.map_width && 0 <= field->target_y && field->target_y < vm.map_height) {
+		uint16_t n = (field->target_y - y0) * width + field->target_x - x0;
+		queue[tail++] = n;
+		directions[n] = FLOW_ARRIVED;
+	}
+
+#define VISIT(_x, _y, way_back) \
+	do { \
+		uint16_t n = (_y) * width + (_x); \
+		if (FLOW_NONE == directions[n] && !tile_has_flag(x0 + (_x), y0 + (_y), field->flag)) { \
+			directions[n] = way_back; \
+			queue[tail++] = n; \
+		} \
+	} while (0)
+
+	while (head < tail) {
+		uint32_t x = queue[head] % width;
+		uint32_t y = queue[head++] / width;
+		if (x + 1 < width) {
+			VISIT(x + 1, y, FLOW_LEFT);
+		}
+		if (x > 0) {
+			VISIT(x - 1, y, FLOW_RIGHT);
+		}
+		if (y + 1 < height) {
+			VISIT(x, y + 1, FLOW_UP);
+		}
+		if (y > 0) {
+			VISIT(x, y - 1, FLOW_DOWN);
+		}
+	}
+
+#undef VISIT
+
+	return true;
+}
+
+// Returns: the field for the flag and target tile, computing it if it's not
+// cached, or NULL if that failed
+static GvmFlowField *flow_field(uint8_t flag, int64_t target_x, int64_t target_y)
+{
+	GvmFlowField *oldest = &vm.flow_fields[0];
+	for (int i = 0; i < N_FLOW_FIELDS; ++i) {
+		GvmFlowField *field = &vm.flow_fields[i];
+		if (NULL != field->directions && field->flag == flag && field->target_x == target_x && field->target_y == target_y) {
+			field->last_used = ++vm.flow_field_clock;
+			return field;
+		}
+		if (NULL == field->directions) {
+			oldest = field;
+			oldest->last_used = 0;
+		} else if (field->last_used < oldest->last_used) {
+			oldest = field;
+		}
+	}
+
+	if (NULL == oldest->directions) {
+		oldest->directions = gvm_malloc(FLOW_FIELD_SIDE * FLOW_FIELD_SIDE);
+		if (NULL == oldest->directions) {
+			return NULL;
+		}
+	}
+	oldest->flag = flag;
+	oldest->target_x = target_x;
+	oldest->target_y = target_y;
+	oldest->last_used = ++vm.flow_field_clock;
+	if (!fill_flow_field(oldest)) {
+		gvm_free(oldest->directions);
+		oldest->directions = NULL;
+		return NULL;
+	}
+	return oldest;
+}
+
+// Returns: a unit step along the shortest path of tiles without the flag from
+// the tile under position to the one under target, or zero if it's already
+// there, or there's no such path within FLOW_FIELD_RADIUS tiles of the target.
+// Fails if the path couldn't be computed.
+static bool next_step(GvmConstant position, GvmConstant target, uint8_t flag, GvmConstant *out_step)
+{
+	*out_step = val_vec2_make(0, 0);
+	int64_t x = tile_at(position.as.vec2[0], vm.map_width);
+	int64_t y = tile_at(position.as.vec2[1], vm.map_height);
+	if (x < 0 || y < 0) {
+		return true;
+	}
+
+	GvmFlowField *field = flow_field(flag, cell_at(target.as.vec2[0]), cell_at(target.as.vec2[1]));
+	if (NULL == field) {
+		return false;
+	}
+
+	x -= field->x0;
+	y -= field->y0;
+	if (x < 0 || y < 0 || x >= field->width || y >= field->height) {
+		return true;
+	}
+
+	switch (field->directions[y * field->width + x]) {
+		case FLOW_LEFT:
+			*out_step = val_vec2_make(int_to_fixed(-1), 0);
+			break;
+		case FLOW_RIGHT:
+			*out_step = val_vec2_make(int_to_fixed(1), 0);
+			break;
+		case FLOW_UP:
+			*out_step = val_vec2_make(0, int_to_fixed(-1));
+			break;
+		case FLOW_DOWN:
+			*out_step = val_vec2_make(0, int_to_fixed(1));
+			break;
+		default:
+			break;
+	}
+	return true;
+}
+
+// Scalars and vec2s live on separate stacks. The parser's static analysis
+// knows the type of every slot, so each opcode is compiled against the stack
+// it needs and never has to look at a tag.
+static FixedPoint peek_scalar()
+{
+	if (vm.scalar_count <= 0) {
 		runtime_error("Stack underflow");
-		return vm.stack[0];
+		return vm.scalars[0];
 	}
 
-	return vm.stack[vm.stack_count - 1];
+	return vm.scalars[vm.scalar_count - 1];
 }
 
-static GvmConstant pop()
+static FixedPoint pop_scalar()
 {
-	if (vm.stack_count <= 0) {
+	if (vm.scalar_count <= 0) {
 		runtime_error("Stack underflow");
-		return vm.stack[0];
+		return vm.scalars[0];
 	}
 
-	return vm.stack[--vm.stack_count];
+	return vm.scalars[--vm.scalar_count];
 }
 
-static void modify(GvmConstant val)
+static void modify_scalar(FixedPoint val)
 {
-	if (vm.stack_count <= 0) {
+	if (vm.scalar_count <= 0) {
 		runtime_error("Stack underflow");
 		return;
 	}
 
-	vm.stack[vm.stack_count - 1] = val;
+	vm.scalars[vm.scalar_count - 1] = val;
 }
 
-static void push(GvmConstant val)
+static void push_scalar(FixedPoint val)
 {
-	if (vm.stack_count >= sizeof(vm.stack) / sizeof(vm.stack[0])) {
+	if (vm.scalar_count >= sizeof(vm.scalars) / sizeof(vm.scalars[0])) {
 		runtime_error("Stack overflow");
 		return;
 	}
 
-	vm.stack[vm.stack_count++] = val;
+	vm.scalars[vm.scalar_count++] = val;
+}
+
+static GvmConstant peek_vec2()
+{
+	if (vm.vec2_count <= 0) {
+		runtime_error("Stack underflow");
+		return vm.vec2s[0];
+	}
+
+	return vm.vec2s[vm.vec2_count - 1];
+}
+
+static GvmConstant pop_vec2()
+{
+	if (vm.vec2_count <= 0) {
+		runtime_error("Stack underflow");
+		return vm.vec2s[0];
+	}
+
+	return vm.vec2s[--vm.vec2_count];
+}
+
+static void modify_vec2(GvmConstant val)
+{
+	if (vm.vec2_count <= 0) {
+		runtime_error("Stack underflow");
+		return;
+	}
+
+	vm.vec2s[vm.vec2_count - 1] = val;
+}
+
+static void push_vec2(GvmConstant val)
+{
+	if (vm.vec2_count >= sizeof(vm.vec2s) / sizeof(vm.vec2s[0])) {
+		runtime_error("Stack overflow");
+		return;
+	}
+
+	vm.vec2s[vm.vec2_count++] = val;
 }
 
 // Return value: true if should quit
@@ -314,84 +947,143 @@ static bool update()
 {
 #define BYTE() (vm.instructions[i++])
 
-	vm.stack_count = 0;
+	vm.scalar_count = 0;
+	vm.vec2_count = 0;
+	vm.entity_count = 0;
+	vm.entity_hash_stale = true;
+	vm.entity_hit_count = 0;
 
 	for (uint32_t i = 0; i < vm.count && !vm.had_error; ) {
 		switch (BYTE()) {
 			case OP_SET: {
 				uint8_t index = BYTE();
-				vm.state[index].value = pop();
+				vm.state[index].as.scalar = pop_scalar();
+				break;
+			}
+			case OP_SET_VEC2: {
+				uint8_t index = BYTE();
+				vm.state[index] = pop_vec2();
 				break;
 			}
 			case OP_GET: {
 				uint8_t index = BYTE();
-				push(vm.state[index].value);
+				push_scalar(vm.state[index].as.scalar);
+				break;
+			}
+			case OP_GET_VEC2: {
+				uint8_t index = BYTE();
+				push_vec2(vm.state[index]);
 				break;
 			}
 			case OP_LOAD_CONST: {
 				uint8_t index = BYTE();
-				push(vm.constants[index]);
+				push_scalar(vm.scalar_constants[index]);
+				break;
+			}
+			case OP_LOAD_CONST_VEC2: {
+				uint8_t index = BYTE();
+				push_vec2(vm.vec2_constants[index]);
+				break;
+			}
+			case OP_LOAD_DATA: {
+				const GvmDataTable *table = &vm.data_tables[BYTE()];
+				FixedPoint index = peek_scalar() / FP_DEN;
+				index = index < 0 ? 0 : index >= table->length ? table->length - 1 : index;
+				modify_scalar(vm.data[table->start + index]);
 				break;
 			}
 			case OP_ADD: {
-				GvmConstant b = pop();
-				GvmConstant a = peek();
-				GvmConstant result = add_vals(a, b);
-				modify(result);
+				FixedPoint b = pop_scalar();
+				FixedPoint a = peek_scalar();
+				modify_scalar(add_scalars(a, b));
 				break;
 			}
 			case OP_SUBTRACT: {
-				GvmConstant b = pop();
-				GvmConstant a = peek();
-				GvmConstant result = subtract_vals(a, b);
-				modify(result);
+				FixedPoint b = pop_scalar();
+				FixedPoint a = peek_scalar();
+				modify_scalar(subtract_scalars(a, b));
 				break;
 			}
 			case OP_MULTIPLY: {
-				GvmConstant b = pop();
-				GvmConstant a = peek();
-				GvmConstant result = multiply_vals(a, b);
-				modify(result);
+				FixedPoint b = pop_scalar();
+				FixedPoint a = peek_scalar();
+				modify_scalar(multiply_scalars(a, b));
+				break;
+			}
+			case OP_ADD_VEC2: {
+				GvmConstant b = pop_vec2();
+				GvmConstant a = peek_vec2();
+				modify_vec2(add_vec2s(a, b));
+				break;
+			}
+			case OP_SUBTRACT_VEC2: {
+				GvmConstant b = pop_vec2();
+				GvmConstant a = peek_vec2();
+				modify_vec2(subtract_vec2s(a, b));
+				break;
+			}
+			case OP_MULTIPLY_VEC2: {
+				GvmConstant b = pop_vec2();
+				GvmConstant a = peek_vec2();
+				modify_vec2(multiply_vec2s(a, b));
 				break;
 			}
 			case OP_MODULO: {
-				GvmConstant b = pop();
-				GvmConstant a = peek();
-				modify(val_modulus(a, b));
+				FixedPoint b = pop_scalar();
+				FixedPoint a = peek_scalar();
+				modify_scalar(val_modulus(a, b));
 				break;
 			}
 			case OP_RAND: {
 				uint8_t index = BYTE();
-				GvmConstant *seed = &vm.state[index].value;
-				push(rand_val(seed));
+				FixedPoint *seed = &vm.state[index].as.scalar;
+				push_scalar(rand_val(seed));
 				break;
 			}
 			case OP_RAND_INT: {
 				uint8_t index = BYTE();
-				GvmConstant *seed = &vm.state[index].value;
-				GvmConstant max = peek();
-				modify(rand_int_val(max, seed));
+				FixedPoint *seed = &vm.state[index].as.scalar;
+				FixedPoint max = peek_scalar();
+				modify_scalar(rand_int_val(max, seed));
 				break;
 			}
 			case OP_GET_X:
-				modify(val_vec2_get_x(peek()));
+				push_scalar(val_vec2_get_x(pop_vec2()));
 				break;
 			case OP_GET_Y:
-				modify(val_vec2_get_y(peek()));
+				push_scalar(val_vec2_get_y(pop_vec2()));
 				break;
-			case OP_MAKE_VEC2:
-				GvmConstant y = pop();
-				GvmConstant x = peek();
-				modify(val_vec2_make(x, y));
+			case OP_MAKE_VEC2: {
+				FixedPoint y = pop_scalar();
+				FixedPoint x = pop_scalar();
+				push_vec2(val_vec2_make(x, y));
 				break;
+			}
 			case OP_NORMALIZE:
 				// TODO: runtime_error on zero
-				modify(val_vec2_normalize(peek()));
+				modify_vec2(val_vec2_normalize(peek_vec2()));
+				break;
+			case OP_LENGTH:
+				push_scalar(val_vec2_length(pop_vec2()));
+				break;
+			case OP_ATAN2:
+				push_scalar(val_vec2_angle(pop_vec2()));
+				break;
+			case OP_ROTATE: {
+				FixedPoint angle = pop_scalar();
+				modify_vec2(val_vec2_rotate(peek_vec2(), angle));
+				break;
+			}
+			case OP_SIN:
+				modify_scalar(val_sin(peek_scalar()));
+				break;
+			case OP_COS:
+				modify_scalar(val_cos(peek_scalar()));
 				break;
 			case OP_JUMP_IF_FALSE: {
-				GvmConstant condition = pop();
+				FixedPoint condition = pop_scalar();
 				uint32_t *target = (uint32_t *)&vm.instructions[i];
-				if (!condition.as.scalar) {
+				if (!condition) {
 					i = *target;
 				} else {
 					i += sizeof(*target);
@@ -404,41 +1096,39 @@ static bool update()
 				break;
 			}
 			case OP_LESS_THAN: {
-				GvmConstant b = pop();
-				GvmConstant a = peek();
-				GvmConstant result = int_to_scalar(val_less_than(a, b));
-				modify(result);
+				FixedPoint b = pop_scalar();
+				FixedPoint a = peek_scalar();
+				modify_scalar(int_to_scalar(val_less_than(a, b)));
 				break;
 			}
 			case OP_GREATER_THAN: {
-				GvmConstant b = pop();
-				GvmConstant a = peek();
-				GvmConstant result = int_to_scalar(val_greater_than(a, b));
-				modify(result);
+				FixedPoint b = pop_scalar();
+				FixedPoint a = peek_scalar();
+				modify_scalar(int_to_scalar(val_greater_than(a, b)));
 				break;
 			}
 			case OP_NOT: {
-				GvmConstant a = peek();
-				modify(val_falsify(a));
+				FixedPoint a = peek_scalar();
+				modify_scalar(val_falsify(a));
 				break;
 			}
 			case OP_AND: {
-				GvmConstant b = pop();
-				GvmConstant a = peek();
-				modify(val_and(a, b));
+				FixedPoint b = pop_scalar();
+				FixedPoint a = peek_scalar();
+				modify_scalar(val_and(a, b));
 				break;
 			}
 			case OP_OR: {
-				GvmConstant b = pop();
-				GvmConstant a = peek();
-				modify(val_or(a, b));
+				FixedPoint b = pop_scalar();
+				FixedPoint a = peek_scalar();
+				modify_scalar(val_or(a, b));
 				break;
 			}
 			case OP_BUTTON_PRESSED:
 				if (button_pressed(BYTE())) {
-					push(double_to_scalar(1));
+					push_scalar(double_to_scalar(1));
 				} else {
-					push(double_to_scalar(0));
+					push_scalar(double_to_scalar(0));
 				}
 				break;
 			case OP_LOAD_PAL: {
@@ -451,38 +1141,59 @@ static bool update()
 				break;
 			}
 			case OP_CAM: {
-				GvmConstant where = pop();
+				GvmConstant where = pop_vec2();
 				set_camera(vec2_get_x(where), vec2_get_y(where));
 				break;
 			}
 			case OP_MAP_WIDTH: {
-				push(double_to_scalar(vm.map_width * SPRITE_SZ));
+				push_scalar(double_to_scalar(vm.map_width * SPRITE_SZ));
 				break;
 			}
 			case OP_MAP_HEIGHT: {
-				push(double_to_scalar(vm.map_height * SPRITE_SZ));
+				push_scalar(double_to_scalar(vm.map_height * SPRITE_SZ));
 				break;
 			}
 			case OP_MAP_FLAG: {
-				uint8_t bit = 1u << BYTE();
-				GvmConstant where = pop();
-				uint8_t flags = get_map_flags(where);
-				push(int_to_scalar((bit & flags) ? 1 : 0));
+				uint8_t flag = BYTE();
+				GvmConstant where = pop_vec2();
+				bool has_flag = map_has_flag(val_vec2_get_x(where), val_vec2_get_y(where), flag);
+				push_scalar(int_to_scalar(has_flag ? 1 : 0));
 				break;
 			}
 			case OP_MOVE_COLLIDE: {
-				GvmConstant velocity = pop();
-				GvmConstant size = pop();
-				GvmConstant position = peek();
-				uint8_t bit = 1u << BYTE();
-				modify(move_collide(position, size, velocity, bit));
+				GvmConstant velocity = pop_vec2();
+				GvmConstant size = pop_vec2();
+				GvmConstant position = peek_vec2();
+				uint8_t flag = BYTE();
+				modify_vec2(move_collide(position, size, velocity, flag));
+				break;
+			}
+			case OP_RAYCAST: {
+				uint8_t flag = BYTE();
+				GvmConstant ray = pop_vec2();
+				GvmConstant origin = pop_vec2();
+				GvmConstant hit;
+				bool did_hit = raycast(origin, ray, flag, &hit);
+				push_vec2(hit);
+				push_scalar(did_hit ? val_vec2_length(subtract_vec2s(hit, origin)) : int_to_scalar(-1));
+				break;
+			}
+			case OP_PATH: {
+				uint8_t flag = BYTE();
+				GvmConstant target = pop_vec2();
+				GvmConstant position = peek_vec2();
+				GvmConstant step;
+				if (!next_step(position, target, flag, &step)) {
+					runtime_error("Failed to find path");
+				}
+				modify_vec2(step);
 				break;
 			}
 			case OP_FILL_RECT: {
 				uint8_t palette = BYTE();
 				uint8_t colour = BYTE();
-				GvmConstant scale = pop();
-				GvmConstant position = pop();
+				GvmConstant scale = pop_vec2();
+				GvmConstant position = pop_vec2();
 				if (!fill_rect(vec2_get_x(position), vec2_get_y(position), vec2_get_x(scale), vec2_get_y(scale), palette, colour)) {
 					runtime_error("Failed to draw rectangle");
 				}
@@ -494,28 +1205,71 @@ static bool update()
 				uint8_t palette = BYTE();
 				uint8_t h_flip = BYTE();
 				uint8_t v_flip = BYTE();
-				GvmConstant position = pop();
+				GvmConstant position = pop_vec2();
 				if (!sprite(vec2_get_x(position), vec2_get_y(position), sheet_x, sheet_y, palette, h_flip, v_flip)) {
 					runtime_error("Failed to draw sprite");
 				}
 				break;
 			}
+			case OP_ENTITY: {
+				uint8_t layer = BYTE();
+				GvmConstant size = pop_vec2();
+				GvmConstant position = pop_vec2();
+				int index = add_entity(position, size, layer);
+				if (index < 0) {
+					runtime_error("Too many entities");
+				}
+				push_scalar(int_to_scalar(index));
+				break;
+			}
+			case OP_OVERLAPS: {
+				uint8_t layer = BYTE();
+				GvmConstant size = pop_vec2();
+				GvmConstant position = pop_vec2();
+				push_scalar(int_to_scalar(query_entities(position, size, layer)));
+				break;
+			}
+			case OP_HIT: {
+				// nth hit of the last OVERLAPS, or -1 past the end
+				FixedPoint n = peek_scalar();
+				int64_t nth = n / FP_DEN;
+				bool in_range = n >= 0 && nth < vm.entity_hit_count;
+				modify_scalar(int_to_scalar(in_range ? vm.entity_hits[nth] : -1));
+				break;
+			}
 			case OP_SWAP: {
-				GvmConstant b = pop();
-				GvmConstant a = peek();
-				modify(b);
-				push(a);
+				FixedPoint b = pop_scalar();
+				FixedPoint a = peek_scalar();
+				modify_scalar(b);
+				push_scalar(a);
+				break;
+			}
+			case OP_SWAP_VEC2: {
+				GvmConstant b = pop_vec2();
+				GvmConstant a = peek_vec2();
+				modify_vec2(b);
+				push_vec2(a);
 				break;
 			}
 			case OP_DUP:
-				push(peek());
+				push_scalar(peek_scalar());
+				break;
+			case OP_DUP_VEC2:
+				push_vec2(peek_vec2());
 				break;
 			case OP_POP:
-				pop();
+				pop_scalar();
+				break;
+			case OP_POP_VEC2:
+				pop_vec2();
 				break;
 			case OP_PRINT: {
-				GvmConstant val = pop();
-				print_value(val);
+				ValueType type = BYTE();
+				if (type == VAL_VEC2) {
+					print_value(pop_vec2(), type);
+				} else {
+					print_value(scalar_to_constant(pop_scalar()), type);
+				}
 				gvm_log("\n");
 				break;
 			}
@@ -535,12 +1289,28 @@ static bool update()
 bool init_vm()
 {
 	vm.state_count = 0;
-	vm.stack_count = 0;
-	vm.constants_count = 0;
+	vm.scalar_count = 0;
+	vm.vec2_count = 0;
+	vm.scalar_constants_count = 0;
+	vm.vec2_constants_count = 0;
+	vm.data = NULL;
+	vm.data_count = 0;
+	vm.data_table_count = 0;
 	for (int i = 0; i < sizeof(vm.sprite_flags) / sizeof(vm.sprite_flags[0]); ++i) {
 		vm.sprite_flags[i] = 0;
+		vm.sprite_shapes[i] = SHAPE_FULL;
+	}
+	vm.map_chunks = NULL;
+	vm.map_chunks_wide = 0;
+	vm.map_chunks_high = 0;
+	for (int i = 0; i < N_FLOW_FIELDS; ++i) {
+		vm.flow_fields[i].directions = NULL;
 	}
-	vm.map = NULL;
+	vm.flow_field_clock = 0;
+	vm.map_changed_flags = 0xff;
+	vm.flow_queue = NULL;
+	vm.map_width = 0;
+	vm.map_height = 0;
 	vm.had_error = false;
 
 	vm.capacity = INSTRUCTIONS_INITIAL_SIZE;
@@ -591,7 +1361,7 @@ static bool locate_state(const char *name, int name_length, int *index)
 	int high = vm.state_count - 1;
 	int current = low + high / 2;
 	for (; low <= high; current = (low + high) / 2) {
-		int cmp = strncmp(name, vm.state[current].name, name_length);
+		int cmp = strncmp(name, vm.state_info[current].name, name_length);
 		if (cmp < 0) {
 			high = current - 1;
 		} else if (cmp > 0) {
@@ -607,7 +1377,7 @@ static bool locate_state(const char *name, int name_length, int *index)
 
 // Insert variable in state list, keeping it sorted by name. Copies name to heap.
 // Returns true on successful insertion
-bool define_state(GvmConstant value, const char *name)
+bool define_state(GvmConstant value, ValueType type, const char *name)
 {
 	if (vm.state_count >= 256) {
 		return false;
@@ -631,27 +1401,28 @@ bool define_state(GvmConstant value, const char *name)
 	// Move all items one to the right
 	for (int i = vm.state_count; i > index; --i) {
 		vm.state[i] = vm.state[i - 1];
+		vm.state_info[i] = vm.state_info[i - 1];
 	}
 
-	GvmState *state = &vm.state[index];
-	state->name = own_name;
-	state->value = value;
+	vm.state[index] = value;
+	vm.state_info[index].name = own_name;
+	vm.state_info[index].type = type;
 	++vm.state_count;
 
 	return true;
 }
 
 // Returns: success
-bool set_state(GvmConstant value, const char *name, int length)
+bool set_state(GvmConstant value, ValueType type, const char *name, int length)
 {
 	int index;
 	bool found = locate_state(name, length, &index);
 	if (!found) {
 		return false;
-	} else if (vm.state[index].value.type != value.type) {
+	} else if (vm.state_info[index].type != type) {
 		return false;
 	} else {
-		vm.state[index].value = value;
+		vm.state[index] = value;
 		return true;
 	}
 }
@@ -681,7 +1452,7 @@ ValueType state_type(const char *name, int length)
 	if (!found) {
 		return VAL_SCALAR;
 	} else {
-		return vm.state[index].value.type;
+		return vm.state_info[index].type;
 	}
 }
 
@@ -698,6 +1469,63 @@ bool state_instruction(uint8_t byte, const char *name, int length)
 	}
 }
 
+// Returns: index of the named data table, or -1 if there's none
+static int locate_data(const char *name, int length)
+{
+	for (int i = 0; i < vm.data_table_count; ++i) {
+		if (0 == strncmp(name, vm.data_names[i], length) && '\0' == vm.data_names[i][length]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Appends a table of values to the VM's data. Copies name and values.
+// Returns: success; false if the name is taken, there are no values, or
+// there are too many tables
+bool define_data(const char *name, int length, const FixedPoint *values, uint32_t count)
+{
+	if (vm.data_table_count >= 256 || 0 == count || locate_data(name, length) >= 0) {
+		return false;
+	}
+
+	char *own_name = gvm_malloc(length + 1);
+	if (NULL == own_name) {
+		return false;
+	}
+	memcpy(own_name, name, length);
+	own_name[length] = '\0';
+
+	FixedPoint *data = gvm_realloc(vm.data, sizeof(*data) * vm.data_count, sizeof(*data) * (vm.data_count + count));
+	if (NULL == data) {
+		gvm_free(own_name);
+		return false;
+	}
+	memcpy(&data[vm.data_count], values, sizeof(*data) * count);
+	vm.data = data;
+
+	vm.data_tables[vm.data_table_count].start = vm.data_count;
+	vm.data_tables[vm.data_table_count].length = count;
+	vm.data_names[vm.data_table_count] = own_name;
+	++vm.data_table_count;
+	vm.data_count += count;
+	return true;
+}
+
+// Emits an instruction to look up the named data table
+// Returns: success
+bool data_instruction(const char *name, int length)
+{
+	int index = locate_data(name, length);
+	if (index < 0) {
+		return false;
+	}
+
+	instruction(OP_LOAD_DATA);
+	instruction(index);
+	return true;
+}
+
 // Returns: success. On success, out_index is a valid argument for resolve_jump().
 // TODO: May be better to explicitly bit-shift to form jumps, or even to give
 // them a dedicated separate array - not nice to read misaligned int32s
@@ -728,20 +1556,25 @@ bool resolve_jump(uint32_t index)
 	return true;
 }
 
-// Adds a value to the constant table and emits instruction to load it
+// Adds a value to the constant table of its type and emits instruction to load it
 // Returns: success
-bool constant(GvmConstant value)
+bool constant(GvmConstant value, ValueType type)
 {
-	if (vm.constants_count >= 256) {
-		return false;
-	}
+	if (type == VAL_VEC2) {
+		if (vm.vec2_constants_count >= 256 || !instruction(OP_LOAD_CONST_VEC2)) {
+			return false;
+		}
 
-	if (!instruction(OP_LOAD_CONST)) {
-		return false;
-	}
+		vm.vec2_constants[vm.vec2_constants_count] = value;
+		return instruction(vm.vec2_constants_count++);
+	} else {
+		if (vm.scalar_constants_count >= 256 || !instruction(OP_LOAD_CONST)) {
+			return false;
+		}
 
-	vm.constants[vm.constants_count] = value;
-	return instruction(vm.constants_count++);
+		vm.scalar_constants[vm.scalar_constants_count] = value.as.scalar;
+		return instruction(vm.scalar_constants_count++);
+	}
 }
 
 void set_sprite_flags(uint8_t flags, int index)
@@ -749,29 +1582,392 @@ void set_sprite_flags(uint8_t flags, int index)
 	vm.sprite_flags[index] = flags;
 }
 
-bool set_introspection_map(const uint8_t (*map)[4], int width, int height)
+void set_sprite_shape(TileShape shape, int index)
+{
+	vm.sprite_shapes[index] = shape;
+}
+
+// Frees every chunk of the map but the empty one, and the table of them
+static void free_map_chunks()
 {
+	if (NULL == vm.map_chunks) {
+		return;
+	}
+
+	for (size_t i = 0; i < (size_t)vm.map_chunks_wide * vm.map_chunks_high; ++i) {
+		if (vm.map_chunks[i] != &empty_chunk) {
+			gvm_free(vm.map_chunks[i]->shaped);
+			gvm_free(vm.map_chunks[i]);
+		}
+	}
+	gvm_free(vm.map_chunks);
+	vm.map_chunks = NULL;
+}
+
+// Replaces the map with an empty one of the given size
+static bool reshape_map(int width, int height)
+{
+	uint32_t chunks_wide = (width + MAP_CHUNK_SZ - 1) / MAP_CHUNK_SZ;
+	uint32_t chunks_high = (height + MAP_CHUNK_SZ - 1) / MAP_CHUNK_SZ;
+	size_t n_chunks = (size_t)chunks_wide * chunks_high;
+	GvmMapChunk **chunks = gvm_malloc(sizeof(*chunks) * (n_chunks > 0 ? n_chunks : 1));
+	if (NULL == chunks) {
+		return false;
+	}
+
+	for (size_t i = 0; i < n_chunks; ++i) {
+		chunks[i] = &empty_chunk;
+	}
+
+	free_map_chunks();
+	free_flow_fields(0xff);
+	vm.map_chunks = chunks;
+	vm.map_chunks_wide = chunks_wide;
+	vm.map_chunks_high = chunks_high;
+	memset(vm.map_shaped_tiles, 0, sizeof(vm.map_shaped_tiles));
+	vm.map_changed_flags = 0xff;
 	vm.map_width = width;
 	vm.map_height = height;
-	vm.map = gvm_malloc(width * height * sizeof(*vm.map));
-	if (NULL == vm.map) {
+	return true;
+}
+
+// Replaces the map with a copy of the seed's. Its chunks are copied rather
+// than shared, since the running VM still reads them.
+static bool seed_map()
+{
+	if (!reshape_map(map_seed->map_width, map_seed->map_height)) {
 		return false;
 	}
 
-	for (int i = 0; i < width * height; ++i) {
-		vm.map[i] = map[i][0] + map[i][1] * SPRITE_COLS;
+	for (size_t i = 0; i < (size_t)vm.map_chunks_wide * vm.map_chunks_high; ++i) {
+		if (map_seed->map_chunks[i] == &empty_chunk) {
+			continue;
+		}
+		GvmMapChunk *copy = gvm_malloc(sizeof(GvmMapChunk));
+		if (NULL == copy) {
+			return false;
+		}
+		memcpy(copy, map_seed->map_chunks[i], sizeof(GvmMapChunk));
+		vm.map_chunks[i] = copy;
+		if (NULL != copy->shaped) {
+			copy->shaped = gvm_malloc(sizeof(GvmShapedTiles));
+			if (NULL == copy->shaped) {
+				return false;
+			}
+			memcpy(copy->shaped, map_seed->map_chunks[i]->shaped, sizeof(GvmShapedTiles));
+		}
+	}
+	memcpy(vm.map_shaped_tiles, map_seed->map_shaped_tiles, sizeof(vm.map_shaped_tiles));
+	vm.map_changed_flags = 0;
+	return true;
+}
+
+// Returns: the chunk holding the map tile at given indices, first swapping
+// the empty chunk there for a copy of its own, or NULL if that failed
+static GvmMapChunk *writable_chunk_at(int x, int y)
+{
+	GvmMapChunk **chunk = &vm.map_chunks[(y / MAP_CHUNK_SZ) * vm.map_chunks_wide + x / MAP_CHUNK_SZ];
+	if (*chunk == &empty_chunk) {
+		GvmMapChunk *copy = gvm_malloc(sizeof(GvmMapChunk));
+		if (NULL == copy) {
+			return NULL;
+		}
+		memcpy(copy, &empty_chunk, sizeof(GvmMapChunk));
+		*chunk = copy;
+	}
+	return *chunk;
+}
+
+// Fills words with bit x of each flag's word set if tiles[x] has the flag.
+// Each flag's bits of eight tiles at a time are gathered by one multiply, and
+// eight tiles without flags are skipped.
+static void flag_words(const uint8_t tiles[MAP_CHUNK_SZ], uint64_t words[N_SPRITE_FLAGS])
+{
+	memset(words, 0, sizeof(uint64_t) * N_SPRITE_FLAGS);
+	for (int x = 0; x < MAP_CHUNK_SZ; x += 8) {
+		uint64_t eight = 0;
+		for (int i = 0; i < 8; ++i) {
+			eight |= (uint64_t)tiles[x + i] << (8 * i);
+		}
+		if (0 == eight) {
+			continue;
+		}
+		for (int flag = 0; flag < N_SPRITE_FLAGS; ++flag) {
+			uint64_t bits = (eight >> flag) & UINT64_C(0x0101010101010101);
+			words[flag] |= ((bits * UINT64_C(0x0102040810204080)) >> 56) << x;
+		}
+	}
+}
+
+// A map of the same size is updated in place, so only the changed tiles are
+// touched. Only chunks with flagged tiles are stored, and only chunks with
+// shaped tiles store their shapes. The map is compared a chunk row at a time.
+bool set_introspection_map(const uint8_t (*map)[4], int width, int height)
+{
+	if (NULL == vm.map_chunks && NULL != map_seed && NULL != map_seed->map_chunks
+		&& width == map_seed->map_width && height == map_seed->map_height) {
+		if (!seed_map()) {
+			return false;
+		}
+	}
+	if (NULL == vm.map_chunks || width != vm.map_width || height != vm.map_height) {
+		if (!reshape_map(width, height)) {
+			return false;
+		}
+	}
+
+	uint8_t changed_flags = 0;
+	for (int y = 0; y < height; ++y) {
+		int row = y % MAP_CHUNK_SZ;
+		for (int x0 = 0; x0 < width; x0 += MAP_CHUNK_SZ) {
+			int x1 = width - x0 < MAP_CHUNK_SZ ? width : x0 + MAP_CHUNK_SZ;
+			// Only full tiles go in the bitmaps the sweep reads
+			uint8_t full_tiles[MAP_CHUNK_SZ] = { 0 };
+			uint8_t shaped_tiles[MAP_CHUNK_SZ] = { 0 };
+			for (int x = x0; x < x1; ++x) {
+				const uint8_t *cell = map[y * width + x];
+				int sprite = cell[0] + cell[1] * SPRITE_MAX_COLS;
+				uint8_t full_mask = SHAPE_FULL == vm.sprite_shapes[sprite] ? 0xff : 0;
+				full_tiles[x - x0] = vm.sprite_flags[sprite] & full_mask;
+				shaped_tiles[x - x0] = vm.sprite_flags[sprite] & ~full_mask;
+			}
+			uint64_t full[N_SPRITE_FLAGS];
+			uint64_t shaped[N_SPRITE_FLAGS];
+			flag_words(full_tiles, full);
+			flag_words(shaped_tiles, shaped);
+			bool any_shaped = false;
+			for (int flag = 0; flag < N_SPRITE_FLAGS; ++flag) {
+				any_shaped |= shaped[flag] != 0;
+			}
+
+			const GvmMapChunk *old = map_chunk_at(x0, y);
+			bool same = !any_shaped && NULL == old->shaped;
+			for (int flag = 0; same && flag < N_SPRITE_FLAGS; ++flag) {
+				same = full[flag] == old->rows[flag][row];
+			}
+			if (same) {
+				continue;
+			}
+
+			GvmMapChunk *chunk = writable_chunk_at(x0, y);
+			if (NULL == chunk) {
+				return false;
+			}
+			uint64_t old_shaped[N_SPRITE_FLAGS] = { 0 };
+			if (NULL != chunk->shaped) {
+				flag_words(&chunk->shaped->flags[row * MAP_CHUNK_SZ], old_shaped);
+			}
+			for (int flag = 0; flag < N_SPRITE_FLAGS; ++flag) {
+				if ((full[flag] | shaped[flag]) != (chunk->rows[flag][row] | old_shaped[flag])) {
+					changed_flags |= 1u << flag;
+				}
+				chunk->rows[flag][row] = full[flag];
+				vm.map_shaped_tiles[flag] += __builtin_popcountll(shaped[flag]) - __builtin_popcountll(old_shaped[flag]);
+			}
+			if (!any_shaped && NULL == chunk->shaped) {
+				continue;
+			}
+
+			if (NULL == chunk->shaped) {
+				chunk->shaped = gvm_malloc(sizeof(GvmShapedTiles));
+				if (NULL == chunk->shaped) {
+					return false;
+				}
+				// All tiles start out full, without flags
+				memset(chunk->shaped, 0, sizeof(GvmShapedTiles));
+			}
+			for (int x = x0; x < x1; ++x) {
+				const uint8_t *cell = map[y * width + x];
+				int sprite = cell[0] + cell[1] * SPRITE_MAX_COLS;
+				bool is_full = SHAPE_FULL == vm.sprite_shapes[sprite] || 0 == vm.sprite_flags[sprite];
+				int tile = row * MAP_CHUNK_SZ + x - x0;
+				chunk->shaped->flags[tile] = is_full ? 0 : vm.sprite_flags[sprite];
+				chunk->shaped->shapes[tile] = is_full ? SHAPE_FULL : vm.sprite_shapes[sprite];
+			}
+		}
 	}
 
+	free_flow_fields(changed_flags);
+	vm.map_changed_flags |= changed_flags;
 	return true;
 }
 
 void close_vm()
 {
 	gvm_free(vm.instructions);
-	gvm_free(vm.map);
+	free_map_chunks();
+	free_flow_fields(0xff);
+	gvm_free(vm.flow_queue);
 	for (int i = 0; i < vm.state_count; ++i) {
-		gvm_free(vm.state[i].name);
+		gvm_free(vm.state_info[i].name);
+	}
+	gvm_free(vm.data);
+	for (int i = 0; i < vm.data_table_count; ++i) {
+		gvm_free(vm.data_names[i]);
+	}
+}
+
+// A reload compiling on a background thread into a VM of its own, with what
+// it has for the renderer staged, so frames carry on meanwhile. The main
+// thread swaps it in between frames once it's done.
+typedef struct {
+	pthread_t thread;
+	bool threaded;
+	atomic_bool done;
+	const char *rom_path;
+	uint8_t force;
+	bool keep_state;
+	// The map is baked from sprite flags, so it needs them even if they
+	// aren't reparsed
+	uint8_t sprite_flags[SPRITE_MAX_COLS * SPRITE_MAX_ROWS];
+	uint8_t sprite_shapes[SPRITE_MAX_COLS * SPRITE_MAX_ROWS];
+	// The VM running meanwhile, whose map doesn't change until this is done
+	const struct VM *running;
+	bool success;
+	uint8_t parsed;
+	struct VM vm;
+	RomStaging staging;
+} ReloadJob;
+
+static ReloadJob reload_job;
+static bool reloading = false;
+
+static void *run_reload(void *arg)
+{
+	ReloadJob *job = arg;
+	job->success = init_vm();
+	if (job->success) {
+		memcpy(vm.sprite_flags, job->sprite_flags, sizeof(vm.sprite_flags));
+		memcpy(vm.sprite_shapes, job->sprite_shapes, sizeof(vm.sprite_shapes));
+		map_seed = job->running;
+		job->success = reload_rom(job->rom_path, job->force, &job->parsed, &job->staging);
+		map_seed = NULL;
+	}
+	if (!job->success) {
+		close_vm();
+	}
+	job->vm = vm;
+	atomic_store(&job->done, true);
+	return NULL;
+}
+
+// Starts reloading the ROM into a fresh VM, on the calling thread if a
+// background one can't be started. Only one reload runs at a time.
+static void start_reload(const char *rom_path, uint8_t force, bool keep_state)
+{
+	reload_job.rom_path = rom_path;
+	reload_job.force = force;
+	reload_job.keep_state = keep_state;
+	memcpy(reload_job.sprite_flags, vm.sprite_flags, sizeof(vm.sprite_flags));
+	memcpy(reload_job.sprite_shapes, vm.sprite_shapes, sizeof(vm.sprite_shapes));
+	memset(&reload_job.staging, 0, sizeof(reload_job.staging));
+	atomic_store(&reload_job.done, false);
+	reloading = true;
+
+	reload_job.running = &vm;
+	reload_job.threaded = 0 == pthread_create(&reload_job.thread, NULL, run_reload, &reload_job);
+	if (!reload_job.threaded) {
+		struct VM current = vm;
+		reload_job.running = &current;
+		run_reload(&reload_job);
+		vm = current;
+	}
+}
+
+// Swaps in the VM of a reload, which takes over the parts of the current one
+// whose sections weren't reparsed, and any state if keep_state
+static void swap_in_vm(struct VM new_vm, uint8_t parsed, bool keep_state)
+{
+	struct VM old_vm = vm;
+	if (!(parsed & ROM_SECTION_UPDATE)) {
+		// Same code, so the same state - with its current values
+		gvm_free(new_vm.instructions);
+		new_vm.instructions = old_vm.instructions;
+		new_vm.capacity = old_vm.capacity;
+		new_vm.count = old_vm.count;
+		memcpy(new_vm.state, old_vm.state, sizeof(new_vm.state));
+		memcpy(new_vm.state_info, old_vm.state_info, sizeof(new_vm.state_info));
+		new_vm.state_count = old_vm.state_count;
+		memcpy(new_vm.scalar_constants, old_vm.scalar_constants, sizeof(new_vm.scalar_constants));
+		new_vm.scalar_constants_count = old_vm.scalar_constants_count;
+		memcpy(new_vm.vec2_constants, old_vm.vec2_constants, sizeof(new_vm.vec2_constants));
+		new_vm.vec2_constants_count = old_vm.vec2_constants_count;
+		gvm_free(new_vm.data);
+		for (int i = 0; i < new_vm.data_table_count; ++i) {
+			gvm_free(new_vm.data_names[i]);
+		}
+		new_vm.data = old_vm.data;
+		new_vm.data_count = old_vm.data_count;
+		memcpy(new_vm.data_tables, old_vm.data_tables, sizeof(new_vm.data_tables));
+		memcpy(new_vm.data_names, old_vm.data_names, sizeof(new_vm.data_names));
+		new_vm.data_table_count = old_vm.data_table_count;
+		old_vm.instructions = NULL;
+		old_vm.state_count = 0;
+		old_vm.data = NULL;
+		old_vm.data_table_count = 0;
+	} else if (keep_state) {
+		vm = old_vm;
+		for (int i = 0; i < new_vm.state_count; ++i) {
+			int index;
+			const char *name = new_vm.state_info[i].name;
+			if (locate_state(name, strlen(name), &index)) {
+				if (vm.state_info[index].type == new_vm.state_info[i].type) {
+					new_vm.state[i] = vm.state[index];
+				}
+			}
+		}
 	}
+
+	if (!(parsed & ROM_SECTION_MAP)) {
+		new_vm.map_chunks = old_vm.map_chunks;
+		new_vm.map_chunks_wide = old_vm.map_chunks_wide;
+		new_vm.map_chunks_high = old_vm.map_chunks_high;
+		memcpy(new_vm.map_shaped_tiles, old_vm.map_shaped_tiles, sizeof(new_vm.map_shaped_tiles));
+		new_vm.map_width = old_vm.map_width;
+		new_vm.map_height = old_vm.map_height;
+		new_vm.map_changed_flags = 0;
+		old_vm.map_chunks = NULL;
+	}
+
+	// A reparsed map was diffed against the current one, so only the fields
+	// over flags it changed are stale
+	memcpy(new_vm.flow_fields, old_vm.flow_fields, sizeof(new_vm.flow_fields));
+	new_vm.flow_field_clock = old_vm.flow_field_clock;
+	new_vm.flow_queue = old_vm.flow_queue;
+	for (int i = 0; i < N_FLOW_FIELDS; ++i) {
+		old_vm.flow_fields[i].directions = NULL;
+	}
+	old_vm.flow_queue = NULL;
+
+	vm = old_vm;
+	close_vm();
+	vm = new_vm;
+	free_flow_fields(vm.map_changed_flags);
+}
+
+// Waits for the reload in flight, then swaps it in if it succeeded and apply
+// Returns: success
+static bool finish_reload(bool apply)
+{
+	if (reload_job.threaded) {
+		pthread_join(reload_job.thread, NULL);
+	}
+	reloading = false;
+
+	bool success = reload_job.success;
+	if (success && apply) {
+		success = commit_staging(&reload_job.staging);
+	}
+	free_staging(&reload_job.staging);
+	if (success && apply) {
+		swap_in_vm(reload_job.vm, reload_job.parsed, reload_job.keep_state);
+	} else if (reload_job.success) {
+		struct VM current = vm;
+		vm = reload_job.vm;
+		close_vm();
+		vm = current;
+	}
+	return success;
 }
 
 // Return value: false if an error occurred preventing execution
@@ -791,7 +1987,7 @@ bool run_vm(const char *rom_path)
 				gvm_error("Could not open file to save state\n");
 			} else {
 				for (int i = 0; i < vm.state_count; ++i) {
-					if (!serialise(vm.state[i].name, vm.state[i].value)) {
+					if (!serialise(vm.state_info[i].name, vm.state[i], vm.state_info[i].type)) {
 						gvm_error("Error serialising state\n");
 						break;
 					}
@@ -802,26 +1998,28 @@ bool run_vm(const char *rom_path)
 			}
 		}
 
-		// Check for queued reload
-		if (will_reload) {
-			will_reload = false;
-			struct VM old_vm = vm;
-			init_vm();
-			if (!load_rom(rom_path)) {
-				gvm_error("Error reloading ROM %s\n", rom_path);
-				close_vm();
-				vm = old_vm;
-			} else {
-				struct VM new_vm = vm;
-				vm = old_vm;
-				close_vm();
-				vm = new_vm;
+		// Swap in a finished reload between frames
+		if (reloading && atomic_load(&reload_job.done)) {
+			if (!finish_reload(true)) {
+				if (reload_job.keep_state) {
+					gvm_error("Error parsing updated ROM %s\n", rom_path);
+				} else {
+					gvm_error("Error reloading ROM %s\n", rom_path);
+				}
 			}
 			input();
 		}
 
-		// Re-parse ROM if appropriate
-		if (rom_timestamp != MODIFY_ERROR) {
+		// Check for queued reload, after any reload in flight
+		if (will_reload && !reloading) {
+			will_reload = false;
+			// Starting over means fresh state, which only compiling gives
+			start_reload(rom_path, ROM_SECTION_UPDATE, false);
+		}
+
+		// Re-parse ROM if appropriate. Changes made while a reload is in
+		// flight are picked up once it's swapped in.
+		if (rom_timestamp != MODIFY_ERROR && !reloading) {
 			time_t new_timestamp = last_modified(rom_path);
 			if (new_timestamp == MODIFY_ERROR) {
 				gvm_error("Cannot watch ROM %s for updates\n", rom_path);
@@ -829,34 +2027,12 @@ bool run_vm(const char *rom_path)
 			} else if (new_timestamp != rom_timestamp) {
 				gvm_log("ROM %s modified: reparsing\n", rom_path);
 				rom_timestamp = new_timestamp;
-				struct VM old_vm = vm;
-				init_vm();
-				if (!load_rom(rom_path)) {
-					gvm_error("Error parsing updated ROM %s\n", rom_path);
-					close_vm();
-					vm = old_vm;
-				} else {
-					// Recover old state
-					struct VM new_vm = vm;
-					vm = old_vm;
-					for (int i = 0; i < new_vm.state_count; ++i) {
-						int index;
-						const char *name = new_vm.state[i].name;
-						if (locate_state(name, strlen(name), &index)) {
-							if (vm.state[index].value.type == new_vm.state[i].value.type) {
-								new_vm.state[i].value = vm.state[index].value;
-							}
-						}
-					}
-					close_vm();
-					vm = new_vm;
-				}
-				input();
+				start_reload(rom_path, 0, true);
 			}
 		}
 
-		// Check for queued load
-		if (NULL != queued_load_path) {
+		// Check for queued load, which can't parse alongside a reload
+		if (NULL != queued_load_path && !reloading) {
 			gvm_log("Loading save %s...\n", queued_load_path);
 			if (!load_state(queued_load_path)) {
 				gvm_error("Error loading save file\n");
@@ -874,5 +2050,9 @@ bool run_vm(const char *rom_path)
 		draw(); // TODO: Unlink vsync from update logic
 		loop_done = loop_done || window_should_close();
 	}
+
+	if (reloading) {
+		finish_reload(false);
+	}
 	return !vm.had_error;
 }
@@ -4,16 +4,25 @@
 #include "common.h"
 #include "value.h"
 
+// Opcodes that touch the stack are typed: unsuffixed ones work on the scalar
+// stack, _VEC2 ones on the vec2 stack
 typedef enum {
 	// State
 	OP_GET,
+	OP_GET_VEC2,
 	OP_SET,
+	OP_SET_VEC2,
 	// Constants
 	OP_LOAD_CONST,
+	OP_LOAD_CONST_VEC2,
+	OP_LOAD_DATA,
 	// Arithmetic
 	OP_ADD,
 	OP_SUBTRACT,
 	OP_MULTIPLY,
+	OP_ADD_VEC2,
+	OP_SUBTRACT_VEC2,
+	OP_MULTIPLY_VEC2,
 	OP_MODULO,
 	OP_RAND,
 	OP_RAND_INT,
@@ -22,6 +31,12 @@ typedef enum {
 	OP_GET_Y,
 	OP_MAKE_VEC2,
 	OP_NORMALIZE,
+	OP_LENGTH,
+	OP_ATAN2,
+	OP_ROTATE,
+	// Trigonometry, in turns
+	OP_SIN,
+	OP_COS,
 	// Control flow
 	OP_JUMP_IF_FALSE,
 	OP_JUMP,
@@ -40,16 +55,35 @@ typedef enum {
 	OP_MAP_HEIGHT,
 	OP_MAP_FLAG,
 	OP_MOVE_COLLIDE,
+	OP_RAYCAST,
+	OP_PATH,
 	OP_FILL_RECT,
 	OP_SPRITE,
+	// Entities
+	OP_ENTITY,
+	OP_OVERLAPS,
+	OP_HIT,
 	// Stack manipulation
 	OP_SWAP,
+	OP_SWAP_VEC2,
 	OP_DUP,
+	OP_DUP_VEC2,
 	OP_POP,
+	OP_POP_VEC2,
 	OP_PRINT,
 	OP_RETURN,
 } OpCode;
 
+// What part of a tile blocks, from its sprite's flag row
+typedef enum {
+	SHAPE_FULL,
+	SHAPE_SLOPE_UP, // floor rising to the right
+	SHAPE_SLOPE_DOWN, // floor falling to the right
+	SHAPE_BOTTOM_HALF,
+	SHAPE_TOP_HALF,
+	SHAPE_ONE_WAY, // only its top, and only from above
+} TileShape;
+
 bool init_vm();
 bool queue_load(const char *path);
 void queue_save();
@@ -57,14 +91,17 @@ void queue_reload();
 bool run_vm(const char *rom_path);
 void close_vm();
 void set_sprite_flags(uint8_t flags, int index);
+void set_sprite_shape(TileShape shape, int index);
 bool set_introspection_map(const uint8_t (*map)[4], int width, int height);
-bool set_state(GvmConstant value, const char *name, int length);
+bool set_state(GvmConstant value, ValueType type, const char *name, int length);
 bool instruction(uint8_t byte);
 ValueType state_type(const char *name, int length);
 bool state_instruction(uint8_t byte, const char *name, int length);
 bool jump(uint8_t byte, uint32_t *out_index);
 bool resolve_jump(uint32_t index);
-bool constant(GvmConstant value);
-bool define_state(GvmConstant value, const char *name);
+bool constant(GvmConstant value, ValueType type);
+bool define_data(const char *name, int length, const FixedPoint *values, uint32_t count);
+bool data_instruction(const char *name, int length);
+bool define_state(GvmConstant value, ValueType type, const char *name);
 
 #endif // VM_H
@@ -5,28 +5,147 @@
 #ifndef VM_INTERNALS_H
 #define VM_INTERNALS_H
 
+// Cold metadata, kept apart from the values so that OP_GET/OP_SET only touch
+// the 16-byte values themselves
 typedef struct {
 	char *name;
-	GvmConstant value;
-} GvmState;
+	ValueType type;
+} GvmStateInfo;
 
-extern struct VM {
+// A table of the DATA section, as a run of the VM's data
+typedef struct {
+	uint32_t start;
+	uint32_t length; // never 0
+} GvmDataTable;
+
+#define MAX_ENTITIES 256
+#define ENTITY_BUCKETS 1024 // power of two
+#define ENTITY_MAX_CELLS 16 // bigger entities skip the hash and are always tested
+#define MAX_ENTITY_CELLS (MAX_ENTITIES * ENTITY_MAX_CELLS)
+
+// An entity registered this frame, as pixel bounds [x0, x1) x [y0, y1)
+typedef struct {
+	FixedPoint x0;
+	FixedPoint y0;
+	FixedPoint x1;
+	FixedPoint y1;
+	uint8_t layer;
+} GvmEntity;
+
+// Chunks are a bitmap word across, so a span of tiles is tested a word a chunk
+#define MAP_CHUNK_SZ 64
+
+// Flags and shape of each tile of a chunk, for tiles that aren't SHAPE_FULL.
+// Full tiles have no flags here, and a shape of SHAPE_FULL.
+typedef struct {
+	// [MAP_CHUNK_SZ][MAP_CHUNK_SZ]
+	uint8_t flags[MAP_CHUNK_SZ * MAP_CHUNK_SZ];
+	uint8_t shapes[MAP_CHUNK_SZ * MAP_CHUNK_SZ];
+} GvmShapedTiles;
+
+// A square of the map. Each flag has a bitmap of full tiles with it: bit x of
+// rows[flag][y]. Tiles that aren't SHAPE_FULL are left out of the bitmaps and
+// resolved separately, so the bitmaps are all most chunks need to store.
+typedef struct {
+	uint64_t rows[N_SPRITE_FLAGS][MAP_CHUNK_SZ];
+	GvmShapedTiles *shaped; // NULL until a tile is shaped
+} GvmMapChunk;
+
+#define N_FLOW_FIELDS 8
+// Fields only reach this many tiles from their target, so that filling one
+// costs the same on any size of map
+#define FLOW_FIELD_RADIUS 64
+#define FLOW_FIELD_SIDE (2 * FLOW_FIELD_RADIUS + 1)
+
+// Which way to step from each tile near a target tile to get nearer it,
+// avoiding tiles with a flag. Covers the part on the map of the square within
+// FLOW_FIELD_RADIUS of the target: [height][width] of FlowDirection, from
+// (x0, y0). directions always has room for the whole square.
+typedef struct {
+	uint8_t *directions;
+	int64_t target_x;
+	int64_t target_y;
+	int64_t x0;
+	int64_t y0;
+	uint32_t width;
+	uint32_t height;
+	uint8_t flag;
+	uint32_t last_used;
+} GvmFlowField;
+
+// Each thread has its own, so a reload can be built on a background thread
+// while the main thread runs the current one
+extern _Thread_local struct VM {
 	uint8_t *instructions;
 	uint32_t capacity;
 	uint32_t count;
-	GvmState state[256];
+	GvmConstant state[256];
+	GvmStateInfo state_info[256];
 	uint32_t state_count;
-	GvmConstant stack[256];
-	uint32_t stack_count;
-	GvmConstant constants[256];
-	uint32_t constants_count;
-	// TODO: We don't need sprite_flags. Saving flags directly in 'map' is more
-	// space-efficient, faster and simpler at runtime.
-	uint8_t sprite_flags[SPRITE_COLS * SPRITE_ROWS];
-	uint16_t *map;
+	FixedPoint scalars[256];
+	uint32_t scalar_count;
+	GvmConstant vec2s[256];
+	uint32_t vec2_count;
+	FixedPoint scalar_constants[256];
+	uint32_t scalar_constants_count;
+	GvmConstant vec2_constants[256];
+	uint32_t vec2_constants_count;
+	// Read-only tables from the DATA section, back to back. Code refers to
+	// them by index, so they go with it.
+	FixedPoint *data;
+	uint32_t data_count;
+	GvmDataTable data_tables[256];
+	char *data_names[256];
+	uint32_t data_table_count;
+	// Only read when the map is set: they're baked into the map then. Indexed
+	// by column + row * SPRITE_MAX_COLS, whatever the sheet's geometry.
+	uint8_t sprite_flags[SPRITE_MAX_COLS * SPRITE_MAX_ROWS];
+	uint8_t sprite_shapes[SPRITE_MAX_COLS * SPRITE_MAX_ROWS]; // TileShape
+	// The map, [map_chunks_high][map_chunks_wide]. Chunks without a flagged
+	// tile all point to one shared, read-only empty chunk.
+	GvmMapChunk **map_chunks;
+	uint32_t map_chunks_wide;
+	uint32_t map_chunks_high;
+	uint32_t map_shaped_tiles[N_SPRITE_FLAGS];
 	uint32_t map_width;
 	uint32_t map_height;
+	// Least recently used is recomputed first. A NULL field is free, and
+	// fields over a flag are freed when the map changes under it.
+	GvmFlowField flow_fields[N_FLOW_FIELDS];
+	uint32_t flow_field_clock;
+	// Flags of the tiles changed since the map was seeded, so a reload keeps
+	// the running VM's fields over the rest; all of them if it wasn't
+	uint8_t map_changed_flags;
+	// Scratch for filling a field, kept between fills: FLOW_FIELD_SIDE squared
+	// indices into one, or NULL until the first
+	uint16_t *flow_queue;
+	// Entities are registered afresh every frame. They're hashed by the
+	// SPRITE_SZ cells they cover, [ENTITY_BUCKETS] runs of indices into
+	// entity_cells, on the first query after any registration.
+	GvmEntity entities[MAX_ENTITIES];
+	uint32_t entity_count;
+	bool entity_hash_stale;
+	uint16_t entity_buckets[ENTITY_BUCKETS + 1]; // start of each run
+	uint8_t entity_cells[MAX_ENTITY_CELLS];
+	uint8_t big_entities[MAX_ENTITIES];
+	uint32_t big_entity_count;
+	// Indices of the entities the last query hit, in ascending order
+	uint8_t entity_hits[MAX_ENTITIES];
+	uint32_t entity_hit_count;
 	bool had_error;
 } vm;
 
+// Returns: the chunk holding the map tile at given indices, which must be on
+// the map
+static inline GvmMapChunk *map_chunk_at(int64_t map_x, int64_t map_y)
+{
+	return vm.map_chunks[(map_y / MAP_CHUNK_SZ) * vm.map_chunks_wide + map_x / MAP_CHUNK_SZ];
+}
+
+// Returns: index of the map tile at given indices within its chunk
+static inline int map_chunk_tile(int64_t map_x, int64_t map_y)
+{
+	return (map_y % MAP_CHUNK_SZ) * MAP_CHUNK_SZ + map_x % MAP_CHUNK_SZ;
+}
+
 #endif // VM_INTERNALS_H